@@ -34,7 +34,40 @@
 #include "base64.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <stdexcept>
+#include <utility>
+#include <vector>
+
+//
+// The vector kernels are compiled for x86 regardless of the
+// -m flags the file is compiled with. Which of them is used is
+// decided at run time, see select_kernel().
+// Defining BASE64_NO_SIMD leaves them out, for targets where
+// ISA-specific code is not allowed.
+//
+#if !defined(BASE64_NO_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define BASE64_X86
+
+#include <immintrin.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define BASE64_TARGET(features)
+#define BASE64_AVX512VBMI
+#else
+#include <cpuid.h>
+#define BASE64_TARGET(features) __attribute__((target(features)))
+#if defined(__clang__) || __GNUC__ >= 8
+#define BASE64_AVX512VBMI
+#endif
+#endif
+
+#endif  // x86
 
 //
 // Depending on the url parameter in base64_chars, one of
@@ -73,59 +106,1151 @@ static const unsigned char from_base64_chars[256] = {
   // clang-format on
 };
 
-static unsigned int pos_of_char(const unsigned char chr) {
+#if defined(BASE64_X86)
+//
+// SSSE3 encoder and decoder for CPUs without AVX2. They use the same
+// pshufb based techniques as the AVX2 kernels below, on 12 input bytes
+// or 16 characters per step.
+//
+BASE64_TARGET("ssse3")
+static __m128i ssse3_enc_offsets(bool url) {
+    //
+    // The offsets that turn the index classes of the encoder into
+    // characters; see avx2_enc_translate below.
+    //
+    const char c62 = to_base64_chars[url][62];
+    const char c63 = to_base64_chars[url][63];
+
+    return _mm_setr_epi8(
+      // clang-format off
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, static_cast<char>(c62 - 62), static_cast<char>(c63 - 63), 'A', 0, 0
+      // clang-format on
+    );
+}
+
+BASE64_TARGET("ssse3")
+static void encode_block_ssse3(unsigned char const* in, char* out, __m128i offsets) {
+    //
+    // Encodes 12 bytes into 16 characters. 16 bytes must be readable.
+    //
+    const __m128i reshuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+
+    const __m128i v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)), reshuffle);
+
+    const __m128i t0      = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1      = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2      = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3      = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    const __m128i indices = _mm_or_si128(t1, t3);
+
+    __m128i cls         = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    cls                 = _mm_or_si128(cls, _mm_and_si128(upper, _mm_set1_epi8(13)));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_add_epi8(_mm_shuffle_epi8(offsets, cls), indices));
+}
+
+BASE64_TARGET("ssse3")
+static size_t encode_ssse3(unsigned char const* in, size_t in_len, char* out, bool url) {
+    //
+    // Each step loads 16 bytes but consumes 12, so 16 bytes must be
+    // readable. Returns the number of bytes consumed.
+    //
+    const __m128i offsets = ssse3_enc_offsets(url);
+
+    size_t pos = 0;
+
+    while (in_len - pos >= 16) {
+        encode_block_ssse3(in + pos, out, offsets);
+
+        pos += 12;
+        out += 16;
+    }
+
+    return pos;
+}
+
+BASE64_TARGET("ssse3")
+static size_t decode_ssse3(const char* in, size_t in_len, unsigned char* out) {
+    //
+    // Same contract as decode_avx2(): stops before a block with an
+    // invalid character, and keeps the 16 byte store of the 12 decoded
+    // bytes within in_len / 4 * 3 bytes by requiring 24 characters.
+    //
+    // clang-format off
+    const __m128i lut_lo     = _mm_setr_epi8(0x25, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x23, 0x3a, 0x3b, 0x3a, 0x3b, 0x32);
+    const __m128i lut_hi     = _mm_setr_epi8(0x20, 0x20, 0x01, 0x02, 0x04, 0x08, 0x04, 0x10, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20);
+    const __m128i lut_roll   = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 16, 0, -65, -32, -71, 0);
+    const __m128i pack_lanes = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    // clang-format on
+    const __m128i nibble_mask = _mm_set1_epi8(0x0f);
+
+    size_t pos = 0;
+
+    while (in_len - pos >= 24) {
+        const __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos));
+
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), nibble_mask);
+        const __m128i lo_nibbles = _mm_and_si128(str, nibble_mask);
+        const __m128i invalid    = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo_nibbles), _mm_shuffle_epi8(lut_hi, hi_nibbles));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(invalid, _mm_setzero_si128())) != 0xffff) break;
+
+        const __m128i lo_is_f = _mm_cmpeq_epi8(lo_nibbles, nibble_mask);
+        const __m128i roll    = _mm_shuffle_epi8(lut_roll, _mm_or_si128(hi_nibbles, _mm_and_si128(lo_is_f, _mm_set1_epi8(8))));
+        const __m128i minus   = _mm_and_si128(_mm_cmpeq_epi8(str, _mm_set1_epi8('-')), _mm_set1_epi8(-2));
+        const __m128i values  = _mm_add_epi8(str, _mm_add_epi8(roll, minus));
+
+        const __m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(merged, pack_lanes));
+
+        pos += 16;
+        out += 12;
+    }
+
+    return pos;
+}
+
+//
+// AVX2 encoder: 24 input bytes are turned into 32 base64 characters
+// per step. Every 32 bit lane receives one 3-byte group, the four
+// 6-bit indices of a group are moved into their own bytes with two
+// multiplications, and the indices are mapped to characters with
+// arithmetic rather than with lookups in to_base64_chars.
+// The technique is described by Wojciech Muła at
+//   http://0x80.pl/notes/2016/01/12/sse-base64-encoding.html
+//
+BASE64_TARGET("avx2")
+static __m256i avx2_enc_reshuffle(__m256i in) {
+    //
+    // Place the bytes of a group so that the big endian 24 bit value
+    // can be split into 6-bit fields within a 32 bit lane.
+    //
+    in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+      // clang-format off
+       1,  0,  2,  1,  4,  3,  5,  4,  7,  6,  8,  7, 10,  9, 11, 10,
+       1,  0,  2,  1,  4,  3,  5,  4,  7,  6,  8,  7, 10,  9, 11, 10
+      // clang-format on
+      ));
+
+    const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+
+    return _mm256_or_si256(t1, t3);
+}
+
+BASE64_TARGET("avx2")
+static __m256i avx2_enc_translate(__m256i indices, bool url) {
+    //
+    // Reduce every index to a small class (0: a-z, 1..10: 0-9, 11 and 12:
+    // the last two characters, 13: A-Z) and add the per class offset.
+    //
+    __m256i cls         = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    const __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    cls                 = _mm256_or_si256(cls, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+
+    const char c62 = to_base64_chars[url][62];
+    const char c63 = to_base64_chars[url][63];
+
+    const __m256i offsets = _mm256_setr_epi8(
+      // clang-format off
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, static_cast<char>(c62 - 62), static_cast<char>(c63 - 63), 'A', 0, 0,
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, static_cast<char>(c62 - 62), static_cast<char>(c63 - 63), 'A', 0, 0
+      // clang-format on
+      );
+
+    return _mm256_add_epi8(_mm256_shuffle_epi8(offsets, cls), indices);
+}
+
+BASE64_TARGET("avx2")
+static void encode_block_avx2(unsigned char const* in, char* out, bool url) {
+    //
+    // Encodes 24 bytes into 32 characters from two overlapping 16-byte
+    // halves, so 28 bytes must be readable.
+    //
+    const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 12));
+    const __m256i v  = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), avx2_enc_translate(avx2_enc_reshuffle(v), url));
+}
+
+BASE64_TARGET("avx2")
+static size_t encode_avx2(unsigned char const* in, size_t in_len, char* out, bool url) {
+    //
+    // Encodes as many 24-byte blocks as can be read safely and returns
+    // the number of bytes consumed. Each step loads two overlapping
+    // 16-byte halves, so 28 bytes must be readable.
+    //
+    size_t pos = 0;
+
+    while (in_len - pos >= 28) {
+        encode_block_avx2(in + pos, out, url);
+
+        pos += 24;
+        out += 32;
+    }
+
+    return pos;
+}
+
+//
+// AVX2 decoder: 32 base64 characters are turned into 24 bytes per step.
+// The characters are classified by their high and low nibble with two
+// pshufb lookups whose bitwise and is zero only for valid characters.
+// Like from_base64_chars, the decoder accepts both '+' and '-' for 62
+// and both '/' and '_' for 63.
+//
+BASE64_TARGET("avx2")
+static size_t decode_avx2(const char* in, size_t in_len, unsigned char* out) {
+    //
+    // Decodes 32-character blocks until a block contains an invalid
+    // character or fewer than 44 characters remain. The latter ensures
+    // that the 32-byte store of the 24 decoded bytes stays within the
+    // in_len / 4 * 3 bytes of the output buffer. Returns the number of
+    // characters consumed; the caller deals with the rest, including
+    // reporting invalid characters.
+    //
+    // clang-format off
+    const __m256i lut_lo = _mm256_setr_epi8(
+      0x25, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x23, 0x3a, 0x3b, 0x3a, 0x3b, 0x32,
+      0x25, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x21, 0x23, 0x3a, 0x3b, 0x3a, 0x3b, 0x32);
+    const __m256i lut_hi = _mm256_setr_epi8(
+      0x20, 0x20, 0x01, 0x02, 0x04, 0x08, 0x04, 0x10, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+      0x20, 0x20, 0x01, 0x02, 0x04, 0x08, 0x04, 0x10, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20);
+    //
+    // Offset to add to a character, indexed by its high nibble, or by its
+    // high nibble + 8 if the low nibble is 0xf ('/', 'O', '_' and 'o').
+    // '+' and '-' share an index; '-' is corrected separately.
+    //
+    const __m256i lut_roll = _mm256_setr_epi8(
+      0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 16, 0, -65, -32, -71, 0,
+      0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 16, 0, -65, -32, -71, 0);
+    const __m256i pack_lanes = _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    // clang-format on
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+
+    size_t pos = 0;
+
+    while (in_len - pos >= 44) {
+        const __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + pos));
+
+        const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), nibble_mask);
+        const __m256i lo_nibbles = _mm256_and_si256(str, nibble_mask);
+
+        if (!_mm256_testz_si256(_mm256_shuffle_epi8(lut_lo, lo_nibbles), _mm256_shuffle_epi8(lut_hi, hi_nibbles))) break;
+
+        const __m256i lo_is_f = _mm256_cmpeq_epi8(lo_nibbles, nibble_mask);
+        const __m256i roll    = _mm256_shuffle_epi8(lut_roll, _mm256_or_si256(hi_nibbles, _mm256_and_si256(lo_is_f, _mm256_set1_epi8(8))));
+        const __m256i minus   = _mm256_and_si256(_mm256_cmpeq_epi8(str, _mm256_set1_epi8('-')), _mm256_set1_epi8(-2));
+        const __m256i values  = _mm256_add_epi8(str, _mm256_add_epi8(roll, minus));
+
+        //
+        // Merge four 6-bit values into one 24 bit value per 32 bit lane,
+        // then gather the 3 significant bytes of each lane.
+        //
+        const __m256i merged = _mm256_madd_epi16(_mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+        const __m256i packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(merged, pack_lanes), _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), packed);
+
+        pos += 32;
+        out += 24;
+    }
+
+    return pos;
+}
+
+#if defined(BASE64_AVX512VBMI)
+#if defined(__GNUC__) && !defined(__clang__)
+//
+// gcc's intrinsics pass _mm512_undefined_epi32() as the merge source of
+// the unmasked vpermb/vpmultishiftqb forms, which trips -Winit-self
+// based maybe-uninitialized warnings once the kernels are inlined.
+//
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+//
+// AVX-512 VBMI encoder: 48 input bytes are turned into 64 characters
+// per step. vpermb spreads the 3-byte groups over 32 bit lanes,
+// vpmultishiftqb extracts the 6-bit indices and a second vpermb looks
+// the characters up in a register holding the whole alphabet.
+// See http://0x80.pl/articles/avx512-foundation-base64.html
+//
+BASE64_TARGET("avx512f,avx512bw,avx512vbmi")
+static __m512i encode_block_avx512vbmi(unsigned char const* in, __m512i alphabet, __mmask64 load_mask = 0x0000ffffffffffff) {
+    //
+    // Returns the 64 characters that encode the 48 bytes at in. The load
+    // is masked, so that no more than the bytes in load_mask are read
+    // (the others count as zero).
+    //
+    const __m512i spread = _mm512_setr_epi32(
+      // clang-format off
+      0x01020001, 0x04050304, 0x07080607, 0x0a0b090a,
+      0x0d0e0c0d, 0x10110f10, 0x13141213, 0x16171516,
+      0x191a1819, 0x1c1d1b1c, 0x1f201e1f, 0x22232122,
+      0x25262425, 0x28292728, 0x2b2c2a2b, 0x2e2f2d2e
+      // clang-format on
+    );
+    const __m512i shifts = _mm512_set1_epi64(0x3036242a1016040a);
+
+    const __m512i v       = _mm512_maskz_loadu_epi8(load_mask, in);
+    const __m512i indices = _mm512_multishift_epi64_epi8(shifts, _mm512_permutexvar_epi8(spread, v));
+
+    return _mm512_permutexvar_epi8(indices, alphabet);
+}
+
+BASE64_TARGET("avx512f,avx512bw,avx512vbmi")
+static size_t encode_avx512vbmi(unsigned char const* in, size_t in_len, char* out, bool url) {
+    const __m512i alphabet = _mm512_loadu_si512(to_base64_chars[url]);
+
+    size_t pos = 0;
+
+    while (in_len - pos >= 48) {
+        _mm512_storeu_si512(out, encode_block_avx512vbmi(in + pos, alphabet));
+
+        pos += 48;
+        out += 64;
+    }
+
+    return pos;
+}
+
+//
+// AVX-512 VBMI decoder: 64 characters are turned into 48 bytes per step.
+// The first 128 entries of from_base64_chars serve as the lookup table
+// of vpermi2b, so that the accepted characters are exactly those of the
+// scalar decoder.
+//
+BASE64_TARGET("avx512f,avx512bw,avx512vbmi")
+static size_t decode_avx512vbmi(const char* in, size_t in_len, unsigned char* out) {
+    //
+    // Stops before a block with an invalid character and returns the
+    // number of characters consumed. The 48 byte store is masked, so
+    // the output buffer needs no slack beyond in_len / 4 * 3 bytes.
+    //
+    const __m512i lookup_lo = _mm512_loadu_si512(from_base64_chars);
+    const __m512i lookup_hi = _mm512_loadu_si512(from_base64_chars + 64);
+    const __m512i pack      = _mm512_setr_epi32(
+      // clang-format off
+      0x06000102, 0x090a0405, 0x0c0d0e08, 0x16101112,
+      0x191a1415, 0x1c1d1e18, 0x26202122, 0x292a2425,
+      0x2c2d2e28, 0x36303132, 0x393a3435, 0x3c3d3e38,
+      0, 0, 0, 0
+      // clang-format on
+    );
+
+    size_t pos = 0;
+
+    while (in_len - pos >= 64) {
+        const __m512i str    = _mm512_loadu_si512(in + pos);
+        const __m512i values = _mm512_permutex2var_epi8(lookup_lo, str, lookup_hi);
+
+        if (_mm512_movepi8_mask(str) | _mm512_test_epi8_mask(values, _mm512_set1_epi8(64))) break;
+
+        const __m512i merged = _mm512_madd_epi16(_mm512_maddubs_epi16(values, _mm512_set1_epi32(0x01400140)), _mm512_set1_epi32(0x00011000));
+
+        _mm512_mask_storeu_epi8(out, 0x0000ffffffffffff, _mm512_permutexvar_epi8(pack, merged));
+
+        pos += 64;
+        out += 48;
+    }
+
+    return pos;
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif  // BASE64_AVX512VBMI
+#endif  // BASE64_X86
+
+//
+// The scalar decoder expands from_base64_chars into four tables whose
+// entries are already shifted to the bit positions of the first, second,
+// third and fourth character of a quad. Invalid characters map to
+// invalid_bits, which lie above the 24 data bits, so that a single test
+// of the or-ed entries validates a whole quad.
+//
+static const uint32_t invalid_bits = 0xff000000;
+
+namespace {
+
+struct decode_tables {
+    uint32_t shifted[4][256];
+
+    decode_tables() {
+        for (unsigned int c = 0; c < 256; c++) {
+            for (unsigned int i = 0; i < 4; i++) {
+                shifted[i][c] = from_base64_chars[c] == 64 ? invalid_bits : uint32_t(from_base64_chars[c]) << (18 - 6 * i);
+            }
+        }
+    }
+};
+
+}  // namespace
+
+static const uint32_t (*decode_table())[256] {
+    static const decode_tables tables;
+    return tables.shifted;
+}
+
+static uint32_t decode_bits(const uint32_t (*table)[256], int i, char c) {
+    return table[i][static_cast<unsigned char>(c)];
+}
+
+//
+// The scalar encoder works on 12-bit values, each of which is turned
+// into two characters with a single lookup in a table of 4096 character
+// pairs. There is one such table for each set of base64 characters.
+// The pairs are stored as uint16_t so that they can be combined into
+// words and written with one store.
+//
+namespace {
+
+struct pair_tables {
+    uint16_t pairs[2][4096];
+
+    pair_tables() {
+        for (int url = 0; url < 2; url++) {
+            for (unsigned int i = 0; i < 4096; i++) {
+                const char pair[2] = {to_base64_chars[url][i >> 6], to_base64_chars[url][i & 0x3f]};
+                std::memcpy(&pairs[url][i], pair, 2);
+            }
+        }
+    }
+};
+
+}  // namespace
+
+static const uint16_t* pair_table(bool url) {
+    static const pair_tables tables;
+    return tables.pairs[url];
+}
+
+//
+// Combine character pairs into words whose memory representation
+// is the pairs in the given order.
+//
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static uint32_t join_pairs(uint16_t a, uint16_t b) { return uint32_t(a) << 16 | b; }
+static uint64_t join_pairs(uint32_t ab, uint32_t cd) { return uint64_t(ab) << 32 | cd; }
+#else
+static uint32_t join_pairs(uint16_t a, uint16_t b) { return a | uint32_t(b) << 16; }
+static uint64_t join_pairs(uint32_t ab, uint32_t cd) { return ab | uint64_t(cd) << 32; }
+#endif
+
+static void encode_six(const uint16_t* pairs, unsigned char const* p, char* out) {
+    //
+    // Encodes two 3-byte groups into 8 characters with a single store.
+    // The first 6 of the 8 loaded bytes form the top 48 bits of a 64 bit
+    // word, which yields four 12-bit indices.
+    //
+    const uint64_t bits  = uint64_t(p[0]) << 56 | uint64_t(p[1]) << 48 | uint64_t(p[2]) << 40 | uint64_t(p[3]) << 32 |
+                          uint64_t(p[4]) << 24 | uint64_t(p[5]) << 16 | uint64_t(p[6]) << 8 | uint64_t(p[7]);
+    const uint64_t chars = join_pairs(join_pairs(pairs[bits >> 52], pairs[bits >> 40 & 0xfff]),
+      join_pairs(pairs[bits >> 28 & 0xfff], pairs[bits >> 16 & 0xfff]));
+
+    std::memcpy(out, &chars, 8);
+}
+
+//
+// The scalar kernels. Like the vector kernels, they encode whole 3-byte
+// groups or decode whole quads into out and return the number of input
+// bytes or characters consumed. Each vector kernel hands what is left
+// of its input to the next narrower one and finally to these.
+// Decoding stops before the first quad with an invalid character.
+//
+// Decoders may be called with out == in: every store of a decoder ends
+// before the first character it has not loaded yet, and nothing is
+// stored for a block that fails the validity test.
+//
+static size_t encode_scalar(unsigned char const* in, size_t in_len, char* out, bool url) {
+    const uint16_t* pairs = pair_table(url);
+
+    size_t pos = 0;
+
+    while (in_len - pos >= 8) {
+        encode_six(pairs, in + pos, out);
+
+        pos += 6;
+        out += 8;
+    }
+
+    while (in_len - pos >= 3) {
+        const unsigned int chunk = unsigned(in[pos + 0]) << 16 | unsigned(in[pos + 1]) << 8 | unsigned(in[pos + 2]);
+        const uint32_t chars     = join_pairs(pairs[chunk >> 12], pairs[chunk & 0xfff]);
+
+        std::memcpy(out, &chars, 4);
+
+        pos += 3;
+        out += 4;
+    }
+
+    return pos;
+}
+
+static size_t decode_scalar(const char* in, size_t in_len, unsigned char* out) {
+    const uint32_t(*table)[256] = decode_table();
+
+    size_t pos = 0;
+
+    while (in_len - pos >= 4) {
+        const char* p        = in + pos;
+        const uint32_t chunk = decode_bits(table, 0, p[0]) | decode_bits(table, 1, p[1]) | decode_bits(table, 2, p[2]) | decode_bits(table, 3, p[3]);
+
+        if (chunk & invalid_bits) break;
+
+        *out++ = static_cast<unsigned char>(chunk >> 16);
+        *out++ = static_cast<unsigned char>(chunk >> 8);
+        *out++ = static_cast<unsigned char>(chunk);
+
+        pos += 4;
+    }
+
+    return pos;
+}
+
+//
+// Line-wrapped encoding for base64_encode_lines, base64_encode_pem and
+// base64_encode_mime. These kernels encode full lines of line_length
+// characters, a multiple of 4, and store the separator after each, as
+// long as more input follows the line. They return the number of bytes
+// consumed, a multiple of line_length / 4 * 3. The vector kernels build
+// a line from whole blocks. Where the line does not end with a block,
+// the SSSE3 and AVX2 kernels store one more block so that it ends with
+// the line, re-encoding part of its predecessor to the same characters.
+// They do so only for lines that hold at least one block and are
+// followed by the bytes a block reads beyond what it consumes.
+//
+namespace {
+
+struct line_format {
+    size_t      line_length;
+    char const* separator;
+    size_t      separator_length;
+};
+
+}  // namespace
+
+//
+// Stores the separator after each line. The kernels keep it on their
+// stack, where it stays in registers: loading it from format would have
+// to be repeated after each store of a line. Separators of up to four
+// characters, such as "\n" and "\r\n", are stored as one word, whose
+// excess characters are overwritten by the next line.
+//
+namespace {
+
+struct separator_writer {
+    char const* chars;
+    size_t      length;
+    uint32_t    word;
+
+    explicit separator_writer(line_format const& format) : chars(format.separator), length(format.separator_length), word(0) {
+        if (length <= 4) std::memcpy(&word, chars, length);
+    }
+
+    void store(char* out) const {
+        if (length <= 4) {
+            std::memcpy(out, &word, 4);
+        } else {
+            std::memcpy(out, chars, length);
+        }
+    }
+};
+
+}  // namespace
+
+static size_t encode_lines_scalar(unsigned char const* in, size_t in_len, char* out, line_format const& format, bool url) {
+    const separator_writer separator(format);
+    const size_t line_length = format.line_length;
+    const size_t line_bytes  = line_length / 4 * 3;
+
+    size_t pos = 0;
+
+    while (in_len - pos > line_bytes) {
+        encode_scalar(in + pos, line_bytes, out, url);
+        separator.store(out + line_length);
+
+        pos += line_bytes;
+        out += line_length + separator.length;
+    }
+
+    return pos;
+}
+
+#if defined(BASE64_X86)
+BASE64_TARGET("ssse3")
+static size_t encode_sse(unsigned char const* in, size_t in_len, char* out, bool url) {
+    const size_t pos = encode_ssse3(in, in_len, out, url);
+    return pos + encode_scalar(in + pos, in_len - pos, out + pos / 3 * 4, url);
+}
+
+BASE64_TARGET("ssse3")
+static size_t decode_sse(const char* in, size_t in_len, unsigned char* out) {
+    const size_t pos = decode_ssse3(in, in_len, out);
+    return pos + decode_scalar(in + pos, in_len - pos, out + pos / 4 * 3);
+}
+
+BASE64_TARGET("avx2")
+static size_t encode_avx2_sse(unsigned char const* in, size_t in_len, char* out, bool url) {
+    const size_t pos = encode_avx2(in, in_len, out, url);
+    return pos + encode_sse(in + pos, in_len - pos, out + pos / 3 * 4, url);
+}
+
+BASE64_TARGET("avx2")
+static size_t decode_avx2_sse(const char* in, size_t in_len, unsigned char* out) {
+    const size_t pos = decode_avx2(in, in_len, out);
+    return pos + decode_sse(in + pos, in_len - pos, out + pos / 4 * 3);
+}
+
+BASE64_TARGET("ssse3")
+static size_t encode_lines_sse(unsigned char const* in, size_t in_len, char* out, line_format const& format, bool url) {
+    const __m128i offsets    = ssse3_enc_offsets(url);
+    const separator_writer separator(format);
+    const size_t line_length = format.line_length;
+    const size_t line_bytes  = line_length / 4 * 3;
+
+    size_t pos = 0;
+
+    while (line_bytes >= 12 && in_len - pos >= line_bytes + 4) {
+        size_t i = 0;
+
+        for (; i + 12 <= line_bytes; i += 12) encode_block_ssse3(in + pos + i, out + i / 3 * 4, offsets);
+        if (i < line_bytes) encode_block_ssse3(in + pos + line_bytes - 12, out + line_length - 16, offsets);
+
+        separator.store(out + line_length);
+
+        pos += line_bytes;
+        out += line_length + separator.length;
+    }
+
+    return pos + encode_lines_scalar(in + pos, in_len - pos, out, format, url);
+}
+
+BASE64_TARGET("avx2")
+static size_t encode_lines_avx2_sse(unsigned char const* in, size_t in_len, char* out, line_format const& format, bool url) {
+    const __m128i offsets    = ssse3_enc_offsets(url);
+    const separator_writer separator(format);
+    const size_t line_length = format.line_length;
+    const size_t line_bytes  = line_length / 4 * 3;
+
+    size_t pos = 0;
+
+    while (line_bytes >= 24 && in_len - pos >= line_bytes + 4) {
+        size_t i = 0;
+
+        for (; i + 24 <= line_bytes; i += 24) encode_block_avx2(in + pos + i, out + i / 3 * 4, url);
+        if (line_bytes - i > 12) encode_block_avx2(in + pos + line_bytes - 24, out + line_length - 32, url);
+        else if (i < line_bytes) encode_block_ssse3(in + pos + line_bytes - 12, out + line_length - 16, offsets);
+
+        separator.store(out + line_length);
+
+        pos += line_bytes;
+        out += line_length + separator.length;
+    }
+
+    return pos + encode_lines_sse(in + pos, in_len - pos, out, format, url);
+}
+
+#if defined(BASE64_AVX512VBMI)
+BASE64_TARGET("avx512f,avx512bw,avx512vbmi")
+static size_t encode_avx512(unsigned char const* in, size_t in_len, char* out, bool url) {
+    const size_t pos = encode_avx512vbmi(in, in_len, out, url);
+    return pos + encode_avx2_sse(in + pos, in_len - pos, out + pos / 3 * 4, url);
+}
+
+BASE64_TARGET("avx512f,avx512bw,avx512vbmi")
+static size_t decode_avx512(const char* in, size_t in_len, unsigned char* out) {
+    const size_t pos = decode_avx512vbmi(in, in_len, out);
+    return pos + decode_avx2_sse(in + pos, in_len - pos, out + pos / 4 * 3);
+}
+
+BASE64_TARGET("avx512f,avx512bw,avx512vbmi")
+static size_t encode_lines_avx512(unsigned char const* in, size_t in_len, char* out, line_format const& format, bool url) {
+    //
+    // Lines that do not end with a whole block end with a partial one,
+    // loaded and stored with masks. Its separator is blended into the
+    // vector if it fits, so that the line ends with a single store.
+    //
+    const __m512i alphabet   = _mm512_loadu_si512(to_base64_chars[url]);
+    const separator_writer separator(format);
+    const size_t line_length = format.line_length;
+    const size_t line_bytes  = line_length / 4 * 3;
+    const size_t full        = line_bytes / 48 * 48;
+    const size_t rest        = line_bytes - full;
+    const size_t rest_chars  = rest / 3 * 4;
+    const bool blend         = rest && rest_chars + separator.length <= 64;
+    const size_t rest_stored = blend ? rest_chars + separator.length : rest_chars;
+
+    const __mmask64 rest_load_mask  = (uint64_t(1) << rest) - 1;
+    const __mmask64 rest_store_mask = rest_stored ? ~uint64_t(0) >> (64 - rest_stored) : 0;
+    const __mmask64 separator_mask  = blend ? ((uint64_t(1) << separator.length) - 1) << rest_chars : 0;
+
+    char separator_block[64] = {};
+    if (blend) std::memcpy(separator_block + rest_chars, separator.chars, separator.length);
+    const __m512i separator_chars = _mm512_loadu_si512(separator_block);
+
+    size_t pos = 0;
+
+    while (full && in_len - pos > line_bytes) {
+        for (size_t i = 0; i < full; i += 48) _mm512_storeu_si512(out + i / 3 * 4, encode_block_avx512vbmi(in + pos + i, alphabet));
+
+        if (rest) {
+            const __m512i last = encode_block_avx512vbmi(in + pos + full, alphabet, rest_load_mask);
+            _mm512_mask_storeu_epi8(out + full / 3 * 4, rest_store_mask, _mm512_mask_blend_epi8(separator_mask, last, separator_chars));
+        }
+        if (!blend) separator.store(out + line_length);
+
+        pos += line_bytes;
+        out += line_length + separator.length;
+    }
+
+    return pos + encode_lines_avx2_sse(in + pos, in_len - pos, out, format, url);
+}
+#endif  // BASE64_AVX512VBMI
+#endif  // BASE64_X86
+
+//
+// Whitespace compaction, the first stage of decoding line-wrapped input.
+// These kernels copy the characters of in that are not whitespace ('\n',
+// '\r', ' ' and '\t') to out and return how many they copied. The vector
+// kernels find the whitespace of a block with a single pshufb lookup and
+// copy blocks without any, by far the most common ones, as they are.
+// They store whole blocks, so out needs 64 bytes of slack. The scalar
+// kernel has none: without vectors, copying the input first costs more
+// than decoding it in place around the whitespace.
+//
+static bool is_whitespace(char c) {
+    return c == '\n' || c == '\r' || c == ' ' || c == '\t';
+}
+
+static size_t compact_scalar(const char* in, size_t in_len, char* out) {
+    size_t n = 0;
+
+    for (size_t i = 0; i < in_len; i++) {
+        out[n] = in[i];
+        n += !is_whitespace(in[i]);
+    }
+
+    return n;
+}
+
+#if defined(BASE64_X86)
+//
+// For each mask of the bytes to keep out of 8, the pshufb indices that
+// move them to the front, and their number.
+//
+namespace {
+
+struct compact_tables {
+    uint64_t shuffle[256];
+    unsigned char count[256];
+
+    compact_tables() {
+        for (unsigned int mask = 0; mask < 256; mask++) {
+            uint64_t indices = 0;
+            unsigned int n   = 0;
+
+            for (unsigned int i = 0; i < 8; i++) {
+                if (mask >> i & 1) indices |= uint64_t(i) << (8 * n++);
+            }
+
+            shuffle[mask] = indices;
+            count[mask]   = static_cast<unsigned char>(n);
+        }
+    }
+};
+
+}  // namespace
+
+static const compact_tables& compact_table() {
+    static const compact_tables tables;
+    return tables;
+}
+
+BASE64_TARGET("ssse3")
+static __m128i whitespace_lut_ssse3() {
+    //
+    // Indexed by the low nibble of a character, the one whitespace
+    // character with that nibble. A character is whitespace if it equals
+    // its entry; pshufb yields 0 for characters with the high bit set.
+    //
+    return _mm_setr_epi8(' ', -1, -1, -1, -1, -1, -1, -1, -1, '\t', '\n', -1, -1, '\r', -1, -1);
+}
+
+BASE64_TARGET("ssse3")
+static size_t compact_block_ssse3(__m128i v, unsigned int keep, char* out, const compact_tables& table) {
+    //
+    // Stores the 16 characters of v whose bit is set in keep, in two
+    // halves of 8, and returns their number.
+    //
+    const unsigned int lo = keep & 0xff;
+    const unsigned int hi = keep >> 8;
+
+    const __m128i lo_indices = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&table.shuffle[lo]));
+    const __m128i hi_indices = _mm_add_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&table.shuffle[hi])), _mm_set1_epi8(8));
+
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(v, lo_indices));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + table.count[lo]), _mm_shuffle_epi8(v, hi_indices));
+
+    return table.count[lo] + table.count[hi];
+}
+
+BASE64_TARGET("ssse3")
+static size_t compact_sse(const char* in, size_t in_len, char* out) {
+    const compact_tables& table = compact_table();
+    const __m128i lut           = whitespace_lut_ssse3();
+
+    size_t pos = 0;
+    size_t n   = 0;
+
+    for (; in_len - pos >= 16; pos += 16) {
+        const __m128i v          = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos));
+        const unsigned int space = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_shuffle_epi8(lut, v))));
+
+        if (!space) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + n), v);
+            n += 16;
+        } else {
+            n += compact_block_ssse3(v, ~space & 0xffff, out + n, table);
+        }
+    }
+
+    return n + compact_scalar(in + pos, in_len - pos, out + n);
+}
+
+BASE64_TARGET("avx2")
+static size_t compact_avx2(const char* in, size_t in_len, char* out) {
+    const compact_tables& table = compact_table();
+    const __m256i lut           = _mm256_broadcastsi128_si256(whitespace_lut_ssse3());
+
+    size_t pos = 0;
+    size_t n   = 0;
+
+    for (; in_len - pos >= 32; pos += 32) {
+        const __m256i v      = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + pos));
+        const uint32_t space = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_shuffle_epi8(lut, v))));
+
+        if (!space) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + n), v);
+            n += 32;
+        } else {
+            n += compact_block_ssse3(_mm256_castsi256_si128(v), ~space & 0xffff, out + n, table);
+            n += compact_block_ssse3(_mm256_extracti128_si256(v, 1), ~space >> 16, out + n, table);
+        }
+    }
+
+    return n + compact_scalar(in + pos, in_len - pos, out + n);
+}
+
+#if defined(BASE64_AVX512VBMI)
+//
+// VBMI2 adds vpcompressb, which compacts a whole block in one
+// instruction. Not every CPU with VBMI has it, so there are two AVX-512
+// kernels, one of them with the AVX2 compaction.
+//
+BASE64_TARGET("avx512f,avx512bw,avx512vbmi2,popcnt")
+static size_t compact_avx512vbmi2(const char* in, size_t in_len, char* out) {
+    //
+    // whitespace_lut_ssse3() in each lane, spelled out as 32 bit values
+    // since gcc's broadcast intrinsic trips -Wmaybe-uninitialized.
+    //
+    const __m512i lut = _mm512_set4_epi32(static_cast<int>(0xffff0dff), static_cast<int>(0xff0a09ff), -1, static_cast<int>(0xffffff20));
+
+    size_t pos = 0;
+    size_t n   = 0;
+
+    for (; in_len - pos >= 64; pos += 64) {
+        const __m512i v      = _mm512_loadu_si512(in + pos);
+        const __mmask64 keep = ~_mm512_cmpeq_epi8_mask(v, _mm512_shuffle_epi8(lut, v));
+
+        _mm512_storeu_si512(out + n, _mm512_maskz_compress_epi8(keep, v));
+        n += static_cast<size_t>(_mm_popcnt_u32(static_cast<uint32_t>(keep)) + _mm_popcnt_u32(static_cast<uint32_t>(keep >> 32)));
+    }
+
+    return n + compact_scalar(in + pos, in_len - pos, out + n);
+}
+#endif  // BASE64_AVX512VBMI
+#endif  // BASE64_X86
+
+namespace {
+
+struct kernel {
+    base64_kernel id;
+    bool          vbmi2;  // requires VBMI2 on top of what id requires
+    size_t (*encode)(unsigned char const* in, size_t in_len, char* out, bool url);
+    size_t (*decode)(const char* in, size_t in_len, unsigned char* out);
+    size_t (*encode_lines)(unsigned char const* in, size_t in_len, char* out, line_format const& format, bool url);
+    size_t (*compact)(const char* in, size_t in_len, char* out);  // null for scalar; read only through resolved_kernel()
+};
+
+}  // namespace
+
+static const kernel kernels[] = {
+  // clang-format off
+  {base64_kernel::scalar, false, encode_scalar,   decode_scalar,   encode_lines_scalar,   nullptr            },
+#if defined(BASE64_X86)
+  {base64_kernel::sse,    false, encode_sse,      decode_sse,      encode_lines_sse,      compact_sse        },
+  {base64_kernel::avx2,   false, encode_avx2_sse, decode_avx2_sse, encode_lines_avx2_sse, compact_avx2       },
+#if defined(BASE64_AVX512VBMI)
+  {base64_kernel::avx512, false, encode_avx512,   decode_avx512,   encode_lines_avx512,   compact_avx2       },
+  {base64_kernel::avx512, true,  encode_avx512,   decode_avx512,   encode_lines_avx512,   compact_avx512vbmi2},
+#endif
+#endif
+  // clang-format on
+};
+
+static const size_t kernel_count = sizeof(kernels) / sizeof(kernels[0]);
+
+namespace {
+
+struct cpu_features {
+    bool ssse3;
+    bool avx2;
+    bool avx512vbmi;
+    bool avx512vbmi2;
+};
+
+}  // namespace
+
+static cpu_features detect_cpu() {
+    //
+    // Checks with cpuid which of the instructions the kernels use the CPU
+    // implements, and with xgetbv whether the OS saves the register state
+    // they need.
+    //
+    cpu_features cpu = {false, false, false, false};
+
+#if defined(BASE64_X86)
+    unsigned int leaf1[4] = {0, 0, 0, 0};
+    unsigned int leaf7[4] = {0, 0, 0, 0};
+    unsigned long long xcr0 = 0;
+
+#if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4];
+    __cpuid(regs, 0);
+    const unsigned int max_leaf = static_cast<unsigned int>(regs[0]);
+    __cpuidex(regs, 1, 0);
+    for (int i = 0; i < 4; i++) leaf1[i] = static_cast<unsigned int>(regs[i]);
+    if (max_leaf >= 7) {
+        __cpuidex(regs, 7, 0);
+        for (int i = 0; i < 4; i++) leaf7[i] = static_cast<unsigned int>(regs[i]);
+    }
+    if (leaf1[2] >> 27 & 1) xcr0 = _xgetbv(0);
+#else
+    const unsigned int max_leaf = __get_cpuid_max(0, nullptr);
+    __cpuid_count(1, 0, leaf1[0], leaf1[1], leaf1[2], leaf1[3]);
+    if (max_leaf >= 7) __cpuid_count(7, 0, leaf7[0], leaf7[1], leaf7[2], leaf7[3]);
+    if (leaf1[2] >> 27 & 1) {
+        unsigned int eax, edx;
+        __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        xcr0 = static_cast<unsigned long long>(edx) << 32 | eax;
+    }
+#endif
+
+    const bool os_ymm = (xcr0 & 0x06) == 0x06;
+    const bool os_zmm = (xcr0 & 0xe6) == 0xe6;
+
+    cpu.ssse3       = leaf1[2] >> 9 & 1;
+    cpu.avx2        = cpu.ssse3 && os_ymm && (leaf1[2] >> 28 & 1) && (leaf7[1] >> 5 & 1);
+    cpu.avx512vbmi  = cpu.avx2 && os_zmm && (leaf7[1] >> 16 & 1) && (leaf7[1] >> 30 & 1) && (leaf7[2] >> 1 & 1);
+    cpu.avx512vbmi2 = cpu.avx512vbmi && (leaf7[2] >> 6 & 1) && (leaf1[2] >> 23 & 1);
+#endif
+
+    return cpu;
+}
+
+static bool cpu_supports(kernel const& k) {
+    const cpu_features cpu = detect_cpu();
+
+    if (k.vbmi2 && !cpu.avx512vbmi2) return false;
+
+    switch (k.id) {
+        case base64_kernel::scalar: return true;
+        case base64_kernel::sse:    return cpu.ssse3;
+        case base64_kernel::avx2:   return cpu.avx2;
+        case base64_kernel::avx512: return cpu.avx512vbmi;
+        default:                    return false;
+    }
+}
+
+static const kernel* find_kernel(base64_kernel id) {
     //
-    // Return the position of chr within base64_encode()
+    // Returns the kernel with the given id if it is compiled in and
+    // supported by the CPU. base64_kernel::automatic yields the widest
+    // such kernel. Of kernels with the same id, the one that comes last
+    // in kernels is preferred.
     //
+    for (size_t i = kernel_count; i-- > 0;) {
+        if ((id == base64_kernel::automatic || kernels[i].id == id) && cpu_supports(kernels[i])) return &kernels[i];
+    }
+    return nullptr;
+}
 
-    if (from_base64_chars[chr] != 64) return from_base64_chars[chr];
+static size_t encode_resolve(unsigned char const* in, size_t in_len, char* out, bool url);
+static size_t decode_resolve(const char* in, size_t in_len, unsigned char* out);
+static size_t encode_lines_resolve(unsigned char const* in, size_t in_len, char* out, line_format const& format, bool url);
 
-    throw std::runtime_error("Input is not valid base64-encoded data.");
-}
+//
+// resolving_kernel has no compact function: compact is null for the
+// scalar kernel, so it is only read through resolved_kernel(), by
+// decode_skipping_whitespace, which checks for null.
+//
+static const kernel resolving_kernel = {base64_kernel::automatic, false, encode_resolve, decode_resolve, encode_lines_resolve, nullptr};
+
+//
+// The kernel used by base64_encode and base64_decode. Until the first
+// call it points at resolving_kernel, whose functions choose the real
+// kernel, store it here and forward the call. Later calls go straight
+// to the chosen kernel.
+//
+static std::atomic<const kernel*> active_kernel(&resolving_kernel);
 
-static std::string insert_linebreaks(std::string str, size_t distance) {
+static const kernel* select_kernel() {
     //
-    // Provided by https://github.com/JomaCorpFX, adapted by me.
+    // The environment variable BASE64_KERNEL forces a kernel. Unknown
+    // names and kernels the CPU cannot run fall back to the automatic
+    // choice.
     //
-    if (str.empty()) return str;
+    static const char* const names[] = {"scalar", "sse", "avx2", "avx512"};
+    static const base64_kernel ids[] = {base64_kernel::scalar, base64_kernel::sse, base64_kernel::avx2, base64_kernel::avx512};
 
-    size_t pos = distance;
+    const kernel* k = nullptr;
 
-    while (pos < str.size()) {
-        str.insert(pos, "\n");
-        pos += distance + 1;
+    if (const char* env = std::getenv("BASE64_KERNEL")) {
+        for (size_t i = 0; i < 4; i++) {
+            if (!std::strcmp(env, names[i])) k = find_kernel(ids[i]);
+        }
     }
+    if (!k) k = find_kernel(base64_kernel::automatic);
 
-    return str;
+    active_kernel.store(k, std::memory_order_relaxed);
+    return k;
 }
 
-template <typename String, unsigned int line_length>
-static std::string encode_with_line_breaks(String s) {
-    return insert_linebreaks(base64_encode(s, false), line_length);
+static const kernel& current_kernel() {
+    return *active_kernel.load(std::memory_order_relaxed);
 }
 
-template <typename String>
-static std::string encode_pem(String s) {
-    return encode_with_line_breaks<String, 64>(s);
+static const kernel& resolved_kernel() {
+    //
+    // Like current_kernel(), but never resolving_kernel, for callers that
+    // keep the kernel for more than one call.
+    //
+    const kernel* k = active_kernel.load(std::memory_order_relaxed);
+    return k == &resolving_kernel ? *select_kernel() : *k;
 }
 
-template <typename String>
-static std::string encode_mime(String s) {
-    return encode_with_line_breaks<String, 76>(s);
+static size_t encode_resolve(unsigned char const* in, size_t in_len, char* out, bool url) {
+    return select_kernel()->encode(in, in_len, out, url);
+}
+
+static size_t decode_resolve(const char* in, size_t in_len, unsigned char* out) {
+    return select_kernel()->decode(in, in_len, out);
+}
+
+static size_t encode_lines_resolve(unsigned char const* in, size_t in_len, char* out, line_format const& format, bool url) {
+    return select_kernel()->encode_lines(in, in_len, out, format, url);
+}
+
+bool base64_set_kernel(base64_kernel id) {
+    const kernel* k = find_kernel(id);
+    if (!k) return false;
+
+    active_kernel.store(k, std::memory_order_relaxed);
+    return true;
+}
+
+base64_kernel base64_get_kernel() {
+    return resolved_kernel().id;
 }
 
 template <typename String>
-static std::string encode(String s, bool url) {
+static std::string encode(String const& s, bool url) {
     return base64_encode(reinterpret_cast<const unsigned char*>(s.data()), s.length(), url);
 }
 
-std::string base64_encode(unsigned char const* bytes_to_encode, size_t in_len, bool url) {
+template <typename String>
+static void encode_append(std::string& dst, String const& s, bool url) {
+    base64_encode_append(dst, reinterpret_cast<const unsigned char*>(s.data()), s.length(), url);
+}
+
+//
+// Inputs of up to 24 bytes or 32 characters take a shortcut that avoids
+// the kernels and their loop overhead: the input is copied into a small
+// buffer padded with neutral values, the whole buffer is converted in
+// fixed-size steps, and the part of the result that is needed is copied
+// out. The copies use two overlapping fixed-width moves rather than a
+// byte loop.
+//
+static void copy_short(void* dst, const void* src, size_t n) {
+    //
+    // Copies n <= 32 bytes.
+    //
+    unsigned char* d       = static_cast<unsigned char*>(dst);
+    const unsigned char* s = static_cast<const unsigned char*>(src);
+
+    if (n >= 16) {
+        std::memcpy(d, s, 16);
+        std::memcpy(d + n - 16, s + n - 16, 16);
+    } else if (n >= 8) {
+        std::memcpy(d, s, 8);
+        std::memcpy(d + n - 8, s + n - 8, 8);
+    } else if (n >= 4) {
+        std::memcpy(d, s, 4);
+        std::memcpy(d + n - 4, s + n - 4, 4);
+    } else if (n) {
+        d[0]     = s[0];
+        d[n / 2] = s[n / 2];
+        d[n - 1] = s[n - 1];
+    }
+}
+
+static void encode_short(unsigned char const* in, size_t in_len, char* out, bool url) {
+    //
+    // Encodes in_len <= 24 bytes into (in_len + 2) / 3 * 4 characters.
+    //
+    static const size_t padding_length[3] = {0, 2, 1};
+
+    unsigned char bytes[32] = {0};
+    char chars[32];
+
+    copy_short(bytes, in, in_len);
+
+    const uint16_t* pairs = pair_table(url);
+    for (size_t i = 0; i * 6 < in_len; i++) encode_six(pairs, bytes + i * 6, chars + i * 8);
+
+    const size_t len_encoded = (in_len + 2) / 3 * 4;
+    const size_t pad         = padding_length[in_len % 3];
+
+    copy_short(out, chars, len_encoded);
+    std::memset(out + len_encoded - pad, url ? '.' : '=', pad);
+}
+
+base64_result base64_encode_to(char* out, size_t cap, unsigned char const* bytes_to_encode, size_t in_len, bool url) {
 
     const size_t len_encoded = (in_len + 2) / 3 * 4;
     const size_t pad         = in_len % 3;
     const size_t len         = in_len - pad;
 
-    unsigned char trailing_char = url ? '.' : '=';
+    if (cap < len_encoded) return {base64_status::buffer_too_small, 0, len_encoded};
+
+    if (in_len <= 24) {
+        encode_short(bytes_to_encode, in_len, out, url);
+        return {base64_status::ok, in_len, len_encoded};
+    }
+
+    const char trailing_char = url ? '.' : '=';
 
     //
     // Choose set of base64 characters. They differ
@@ -138,96 +1263,541 @@ std::string base64_encode(unsigned char const* bytes_to_encode, size_t in_len, b
     //
     const char* base64_chars_ = to_base64_chars[url];
 
+    const size_t pos = current_kernel().encode(bytes_to_encode, in_len, out, url);
+    out += len / 3 * 4;
+
+    if (pad) {
+        //
+        // The last one or two bytes become a padded quad with the same four
+        // stores in either case. A missing second byte is masked to zero and
+        // the third character is picked from a table indexed by pad.
+        //
+        static const unsigned int second_byte_mask[3] = {0, 0, 0xff};
+
+        const unsigned int chunk = unsigned(bytes_to_encode[pos]) << 16 | (bytes_to_encode[pos + pad - 1] & second_byte_mask[pad]) << 8;
+        const char third[3]      = {0, trailing_char, base64_chars_[chunk >> 6 & 0x3f]};
+
+        out[0] = base64_chars_[chunk >> 18];
+        out[1] = base64_chars_[chunk >> 12 & 0x3f];
+        out[2] = third[pad];
+        out[3] = trailing_char;
+    }
+
+    return {base64_status::ok, in_len, len_encoded};
+}
+
+template <typename Write>
+static void append_with(std::string& s, size_t n, Write write) {
+    //
+    // Grows s by n characters that write(char* p) fills in through a plain
+    // pointer. write returns how many of them it used, and s is cut back
+    // accordingly. With C++23, resize_and_overwrite spares zero-filling
+    // characters that are overwritten anyway.
+    //
+    const size_t size = s.size();
+#if defined(__cpp_lib_string_resize_and_overwrite)
+    s.resize_and_overwrite(size + n, [&](char* p, size_t) { return size + write(p + size); });
+#else
+    s.resize(size + n);
+    s.resize(size + write(&s[size]));
+#endif
+}
+
+static bool points_into(std::string const& s, const void* p) {
+    const std::less<const char*> before;
+    const char* c = static_cast<const char*>(p);
+    return !before(c, s.data()) && before(c, s.data() + s.size());
+}
+
+template <typename Char, typename Write>
+static void append_from(std::string& s, size_t n, const Char* in, Write write) {
+    //
+    // Like append_with, for a write(char* p, const Char* in) that reads
+    // from in, which may point into s itself, as in
+    // base64_encode_append(s, s). Growing s may move its contents, so such
+    // an in is passed on at its offset in s as it is after growing.
+    //
+    const size_t size   = s.size();
+    const bool inside   = points_into(s, in);
+    const size_t offset = inside ? static_cast<size_t>(reinterpret_cast<const char*>(in) - s.data()) : 0;
+
+    append_with(s, n, [&](char* p) { return write(p, inside ? reinterpret_cast<const Char*>(p - size + offset) : in); });
+}
+
+void base64_encode_append(std::string& dst, unsigned char const* bytes_to_encode, size_t in_len, bool url) {
+    const size_t len_encoded = base64_encoded_size(in_len);
+    append_from(dst, len_encoded, bytes_to_encode, [&](char* p, unsigned char const* in) { return base64_encode_to(p, len_encoded, in, in_len, url).length; });
+}
+
+std::string base64_encode(unsigned char const* bytes_to_encode, size_t in_len, bool url) {
     std::string ret;
-    ret.reserve(len_encoded);
+    base64_encode_append(ret, bytes_to_encode, in_len, url);
+    return ret;
+}
+
+void base64_encode_batch(base64_input const* inputs, size_t count, base64_batch& batch, bool url) {
+    //
+    // The first pass computes where each encoding goes, so that chars is
+    // sized once. The second encodes every input straight into place.
+    //
+    batch.offsets.resize(count + 1);
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        batch.offsets[i] = total;
+        total += base64_encoded_size(inputs[i].length);
+    }
+    batch.offsets[count] = total;
 
-    unsigned int pos = 0;
-    unsigned int chunk;
+    batch.chars.clear();
+    append_with(batch.chars, total, [&](char* out) {
+        for (size_t i = 0; i < count; i++) {
+            base64_encode_to(out + batch.offsets[i], batch.offsets[i + 1] - batch.offsets[i], inputs[i].data, inputs[i].length, url);
+        }
+        return total;
+    });
+}
 
-    while (pos < len) {
-        chunk = unsigned(bytes_to_encode[pos + 0]) << 16 | unsigned(bytes_to_encode[pos + 1]) << 8 | unsigned(bytes_to_encode[pos + 2]);
-        ret.push_back(base64_chars_[chunk >> 18]);
-        ret.push_back(base64_chars_[chunk >> 12 & 0x3f]);
-        ret.push_back(base64_chars_[chunk >> 6 & 0x3f]);
-        ret.push_back(base64_chars_[chunk & 0x3f]);
+base64_batch base64_encode_batch(base64_input const* inputs, size_t count, bool url) {
+    base64_batch batch;
+    base64_encode_batch(inputs, count, batch, url);
+    return batch;
+}
 
-        pos += 3;
+//
+// The pool of the buffers behind base64_buffer. Each thread has its own,
+// so that neither taking nor returning a buffer needs a lock. A buffer
+// that outlives its thread's pool (a thread_local base64_buffer, say) is
+// simply freed.
+//
+// pool is constructed on first use in a thread and destroyed at thread
+// exit, possibly before other thread_local objects that use it. Every
+// access checks buffer_pool_state first. Only base64_encode_pooled
+// constructs the pool, since its constructor allocates.
+//
+static const size_t max_pooled_buffers = 16;
+
+enum class pool_state : unsigned char { unused, live, destroyed };
+
+static thread_local pool_state buffer_pool_state = pool_state::unused;
+
+namespace {
+
+struct buffer_pool {
+    std::vector<std::string> buffers;
+    size_t                   hits   = 0;
+    size_t                   misses = 0;
+
+    buffer_pool() {
+        buffers.reserve(max_pooled_buffers);
+        buffer_pool_state = pool_state::live;
     }
+    ~buffer_pool() { buffer_pool_state = pool_state::destroyed; }
+};
 
-    switch (pad) {
-        case 2:
-            chunk = int(bytes_to_encode[pos + 0]) << 8 | int(bytes_to_encode[pos + 1]);
-            ret.push_back(base64_chars_[chunk >> 10]);
-            ret.push_back(base64_chars_[chunk >> 4 & 0x3f]);
-            ret.push_back(base64_chars_[chunk << 2 & 0x3f]);
-            ret.push_back(trailing_char);
-            break;
-        case 1:
-            chunk = int(bytes_to_encode[pos + 0]);
-            ret.push_back(base64_chars_[chunk >> 2]);
-            ret.push_back(base64_chars_[chunk << 4 & 0x3f]);
-            ret.push_back(trailing_char);
-            ret.push_back(trailing_char);
-            break;
-        default:
-            break;
+}  // namespace
+
+static thread_local buffer_pool pool;
+
+base64_buffer::base64_buffer(base64_buffer&& other) noexcept : chars_(std::move(other.chars_)), pooled_(other.pooled_) {
+    other.pooled_ = false;
+}
+
+base64_buffer& base64_buffer::operator=(base64_buffer&& other) noexcept {
+    //
+    // Our buffer goes back to the pool when other is destroyed.
+    //
+    std::swap(chars_, other.chars_);
+    std::swap(pooled_, other.pooled_);
+    return *this;
+}
+
+base64_buffer::~base64_buffer() {
+    //
+    // buffers has room for max_pooled_buffers, so push_back does not
+    // allocate.
+    //
+    if (pooled_ && buffer_pool_state == pool_state::live && pool.buffers.size() < max_pooled_buffers) pool.buffers.push_back(std::move(chars_));
+}
+
+base64_buffer base64_encode_pooled(unsigned char const* bytes_to_encode, size_t in_len, bool url) {
+    base64_buffer ret;
+
+    if (buffer_pool_state != pool_state::destroyed) {
+        if (!pool.buffers.empty()) {
+            ret.chars_ = std::move(pool.buffers.back());
+            pool.buffers.pop_back();
+            pool.hits++;
+        } else {
+            pool.misses++;
+        }
     }
 
+    ret.pooled_ = true;
+    ret.chars_.clear();
+    base64_encode_append(ret.chars_, bytes_to_encode, in_len, url);
+
+    return ret;
+}
+
+base64_pool_stats base64_get_pool_stats() {
+    base64_pool_stats stats = {0, 0, 0, 0};
+    if (buffer_pool_state != pool_state::live) return stats;
+
+    stats.hits             = pool.hits;
+    stats.misses           = pool.misses;
+    stats.retained_buffers = pool.buffers.size();
+    for (size_t i = 0; i < pool.buffers.size(); i++) stats.retained_bytes += pool.buffers[i].capacity();
+    return stats;
+}
+
+void base64_trim_pool() {
+    if (buffer_pool_state == pool_state::live) pool.buffers.clear();
+}
+
+static void encode_lines(unsigned char const* in, size_t in_len, char* out, line_format const& format, bool url) {
+    //
+    // Encodes in with a separator after every line_length characters, in
+    // a single pass: the kernel encodes all full lines but the last, and
+    // the last line, which has no separator and carries the padding, is
+    // encoded here.
+    //
+    const size_t pos = current_kernel().encode_lines(in, in_len, out, format, url);
+    out += pos / (format.line_length / 4 * 3) * (format.line_length + format.separator_length);
+
+    base64_encode_to(out, base64_encoded_size(in_len - pos), in + pos, in_len - pos, url);
+}
+
+static std::string encode_with_line_breaks(unsigned char const* in, size_t len, line_format const& format, bool url) {
+    const size_t len_lines = base64_encoded_size(len, url, format.line_length, format.separator_length);
+
+    std::string ret;
+    append_with(ret, len_lines, [&](char* out) {
+        encode_lines(in, len, out, format, url);
+        return len_lines;
+    });
+
     return ret;
 }
 
 template <typename String>
-static std::string decode(String encoded_string, bool remove_linebreaks) {
+static std::string encode_pem(String const& s) {
+    static const line_format pem = {64, "\n", 1};
+    return encode_with_line_breaks(reinterpret_cast<const unsigned char*>(s.data()), s.length(), pem, false);
+}
+
+template <typename String>
+static std::string encode_mime(String const& s) {
+    static const line_format mime = {76, "\n", 1};
+    return encode_with_line_breaks(reinterpret_cast<const unsigned char*>(s.data()), s.length(), mime, false);
+}
+
+static bool is_padding(char c) {
+    return c == '=' || c == '.';  // accept URL-safe base 64 strings, too, so check for '.' also.
+}
+
+static base64_result fail_invalid_char(const char* in, size_t pos) {
+    //
+    // A kernel or the final quad reported an invalid character somewhere
+    // at or after pos. Find out where exactly.
+    //
+    while (from_base64_chars[static_cast<unsigned char>(in[pos])] != 64) pos++;
+    return {base64_status::invalid_char, pos, 0};
+}
+
+static base64_result decode_short(const char* in, size_t in_len, unsigned char* out, unsigned int pad2, unsigned int pad3) {
+    //
+    // Decodes 4 <= in_len <= 32 characters, in_len a multiple of 4. Padding
+    // characters are replaced by 'A', which contributes zero bits, and the
+    // validity of all quads is tested once at the end.
+    //
+    char chars[32];
+    unsigned char bytes[24];
+
+    std::memset(chars, 'A', sizeof(chars));
+    copy_short(chars, in, in_len);
+
+    chars[in_len - 2] = pad2 ? 'A' : chars[in_len - 2];
+    chars[in_len - 1] = pad3 ? 'A' : chars[in_len - 1];
+
+    const uint32_t(*table)[256] = decode_table();
+    uint32_t invalid             = 0;
+
+    for (size_t i = 0; i < in_len / 4; i++) {
+        const char* p        = chars + i * 4;
+        const uint32_t chunk = decode_bits(table, 0, p[0]) | decode_bits(table, 1, p[1]) | decode_bits(table, 2, p[2]) | decode_bits(table, 3, p[3]);
+
+        invalid |= chunk;
+        bytes[i * 3 + 0] = static_cast<unsigned char>(chunk >> 16);
+        bytes[i * 3 + 1] = static_cast<unsigned char>(chunk >> 8);
+        bytes[i * 3 + 2] = static_cast<unsigned char>(chunk);
+    }
+
+    if (invalid & invalid_bits) return fail_invalid_char(in, 0);
+
+    const size_t len_decoded = in_len / 4 * 3 - pad2 - pad3;
+    copy_short(out, bytes, len_decoded);
+
+    return {base64_status::ok, in_len, len_decoded};
+}
+
+base64_result base64_decode_to(unsigned char* out, size_t cap, char const* in, size_t in_len) {
+    //
+    // Decodes in_len characters (without line breaks) into out.
+    //
+    if (in_len == 0) return {base64_status::ok, 0, 0};
+    if (in_len % 4) return {base64_status::bad_length, in_len, 0};
+
+    const unsigned int pad2 = is_padding(in[in_len - 2]);
+    const unsigned int pad3 = is_padding(in[in_len - 1]);
+
+    if (pad2 > pad3) return {base64_status::bad_padding, in_len - 1, 0};
+
+    const size_t len_decoded = in_len / 4 * 3 - pad2 - pad3;
+    if (cap < len_decoded) return {base64_status::buffer_too_small, 0, len_decoded};
+
+    if (in_len <= 32) return decode_short(in, in_len, out, pad2, pad3);
+
+    //
+    // All but the last quad are decoded by the kernel, which stops
+    // early if it encounters an invalid character. The last quad might
+    // be padded and is dealt with here.
+    //
+    const size_t len = in_len - 4;
+
+    const size_t pos = current_kernel().decode(in, len, out);
+    if (pos < len) return fail_invalid_char(in, pos);
+
+    out += len / 4 * 3;
+
+    //
+    // Padding characters in the last quad contribute no bits: their
+    // table entries are masked away, so that the quad is decoded with one
+    // validity test whether it carries zero, one or two padding
+    // characters. The n remaining bytes are written with three stores,
+    // the middle and last of which coincide if n < 3.
+    //
+    const uint32_t(*table)[256] = decode_table();
+    const char* p                = in + len;
+
+    const uint32_t chunk = decode_bits(table, 0, p[0]) | decode_bits(table, 1, p[1]) |
+                           (decode_bits(table, 2, p[2]) & (pad2 - 1)) | (decode_bits(table, 3, p[3]) & (pad3 - 1));
+
+    if (chunk & invalid_bits) return fail_invalid_char(in, len);
+
+    const unsigned char bytes[3] = {static_cast<unsigned char>(chunk >> 16), static_cast<unsigned char>(chunk >> 8), static_cast<unsigned char>(chunk)};
+    const size_t n               = 3 - pad2 - pad3;
+    const size_t mid             = n > 1;
+
+    out[0]     = bytes[0];
+    out[mid]   = bytes[mid];
+    out[n - 1] = bytes[n - 1];
+
+    return {base64_status::ok, in_len, len_decoded};
+}
+
+static base64_result decode_into(const char* in, size_t in_len, std::string& ret) {
+    //
+    // Decodes in_len characters (without line breaks) and appends them to
+    // ret, which grows once by exactly the decoded size and is restored if
+    // decoding fails.
+    //
+    const size_t  len_decoded = base64_decoded_size(in, in_len);
+    base64_result result;
+
+    append_from(ret, len_decoded, in, [&](char* p, const char* chars) {
+        result = base64_decode_to(reinterpret_cast<unsigned char*>(p), len_decoded, chars, in_len);
+        return result.status == base64_status::ok ? result.length : 0;
+    });
+
+    return result;
+}
+
+base64_result base64_decode_inplace(char* buf, size_t len) {
+    //
+    // Safe because the output never overtakes the input: the kernels, the
+    // short path (which copies its input first) and the final quad all
+    // store decoded bytes only where characters have already been read.
+    //
+    return base64_decode_to(reinterpret_cast<unsigned char*>(buf), len, buf, len);
+}
+
+base64_result base64_decode_inplace(std::string& s) {
+    const base64_result result = base64_decode_inplace(&s[0], s.size());
+
+    if (result.status == base64_status::ok) {
+        s.resize(result.length);
+    } else {
+        s.clear();
+    }
+
+    return result;
+}
+
+static base64_result decode_gathering(const char* in, size_t in_len, size_t pos, unsigned char* begin, unsigned char* out) {
+    //
+    // Decodes the characters from pos on, with whitespace anywhere
+    // between them, into out, where the bytes decoded so far end. The
+    // kernel takes the input as is and stops before the first quad with
+    // whitespace (or an invalid or padding character). That quad is
+    // gathered character by character, skipping whitespace, and then the
+    // kernel takes over again. Error offsets refer to in as given.
+    //
+    // out needs room for (in_len - pos) / 4 * 3 bytes: the kernel might
+    // be handed quads that turn out to contain whitespace, but it stores
+    // within what those would decode to.
+    //
+    const kernel& k             = resolved_kernel();
+    const uint32_t(*table)[256] = decode_table();
+
+    for (;;) {
+        const size_t consumed = k.decode(in + pos, in_len - pos, out);
+
+        pos += consumed;
+        out += consumed / 4 * 3;
+
+        size_t quad[4];
+        size_t n = 0;
+
+        for (; n < 4 && pos < in_len; pos++) {
+            if (!is_whitespace(in[pos])) quad[n++] = pos;
+        }
+
+        if (n == 0) break;
+        if (n < 4) return {base64_status::bad_length, in_len, 0};
+
+        const unsigned int pad2 = is_padding(in[quad[2]]);
+        const unsigned int pad3 = is_padding(in[quad[3]]);
+
+        const uint32_t chunk = decode_bits(table, 0, in[quad[0]]) | decode_bits(table, 1, in[quad[1]]) |
+                               (decode_bits(table, 2, in[quad[2]]) & (pad2 - 1)) | (decode_bits(table, 3, in[quad[3]]) & (pad3 - 1));
+
+        if (chunk & invalid_bits) {
+            size_t i = 0;
+            while (from_base64_chars[static_cast<unsigned char>(in[quad[i]])] != 64) i++;
+            return {base64_status::invalid_char, quad[i], 0};
+        }
+        if (pad2 > pad3) return {base64_status::bad_padding, quad[3], 0};
+
+        *out++ = static_cast<unsigned char>(chunk >> 16);
+        if (!pad2) *out++ = static_cast<unsigned char>(chunk >> 8);
+        if (!pad3) *out++ = static_cast<unsigned char>(chunk);
+
+        if (pad3) {
+            //
+            // A padded quad must be the last one.
+            //
+            while (pos < in_len && is_whitespace(in[pos])) pos++;
+            if (pos < in_len) return {base64_status::invalid_char, quad[pad2 ? 2 : 3], 0};
+            break;
+        }
+    }
+
+    return {base64_status::ok, in_len, static_cast<size_t>(out - begin)};
+}
+
+static size_t skip_characters(const char* in, size_t pos, size_t n) {
+    //
+    // Returns the position after the first n characters from pos on that
+    // are not whitespace.
+    //
+    for (; n; pos++) n -= !is_whitespace(in[pos]);
+    return pos;
+}
+
+static const size_t compact_tile = 4096;
+
+static base64_result decode_skipping_whitespace(const char* in, size_t in_len, unsigned char* out) {
+    //
+    // Decodes in_len characters with whitespace anywhere between them.
+    // The input is compacted tile by tile into a buffer that stays in the
+    // L1 cache, and the kernel decodes the whole quads of each tile. The
+    // characters of a tile that do not make a whole quad are compacted
+    // again with the next one. Whatever the kernel stops at, the padded
+    // last quad or an invalid character, is left to decode_gathering,
+    // which reports errors at their offset in in.
+    //
+    // out needs room for in_len / 4 * 3 bytes.
+    //
+    const kernel& k            = resolved_kernel();
+    unsigned char* const begin = out;
+
+    if (!k.compact) return decode_gathering(in, in_len, 0, begin, out);
+
+    char tile[compact_tile + 64];
+
+    size_t pos = 0;
+
+    while (in_len - pos >= compact_tile) {
+        const size_t n     = k.compact(in + pos, compact_tile, tile);
+        const size_t quads = n / 4 * 4;
+
+        if (!quads) break;
+
+        const size_t consumed = k.decode(tile, quads, out);
+        out += consumed / 4 * 3;
+
+        if (consumed < quads) return decode_gathering(in, in_len, skip_characters(in, pos, consumed), begin, out);
+
+        pos += compact_tile;
+        for (size_t left = n - quads; left;) left -= !is_whitespace(in[--pos]);
+    }
+
+    return decode_gathering(in, in_len, pos, begin, out);
+}
+
+template <typename String>
+static base64_result decode(String const& encoded_string, std::string& out, bool remove_linebreaks) {
     //
     // decode(…) is templated so that it can be used with String = const std::string&
     // or std::string_view (requires at least C++17)
     //
-
-    if (encoded_string.empty()) return std::string();
+    // The decoded bytes are appended to out.
+    //
 
     if (remove_linebreaks) {
+        //
+        // The decoded bytes take at most three quarters of the input's
+        // length, whitespace or not.
+        //
+        const size_t  len = encoded_string.length();
+        base64_result result;
 
-        std::string copy(encoded_string);
-
-        copy.erase(std::remove(copy.begin(), copy.end(), '\n'), copy.end());
+        append_from(out, len / 4 * 3, encoded_string.data(), [&](char* p, const char* chars) {
+            result = decode_skipping_whitespace(chars, len, reinterpret_cast<unsigned char*>(p));
+            return result.status == base64_status::ok ? result.length : 0;
+        });
 
-        return base64_decode(copy, false);
+        return result;
     }
 
-    size_t in_len = encoded_string.length();
-    size_t pos    = 0;
+    return decode_into(encoded_string.data(), encoded_string.length(), out);
+}
 
+template <typename String>
+static base64_result decode_replacing(String const& encoded_string, std::string& out, bool remove_linebreaks) {
     //
-    // The approximate length (bytes) of the decoded string might be one ore
-    // two bytes smaller, depending on the amount of trailing equal signs
-    // in the encoded string. This approximation is needed to reserve
-    // enough space in the string to be returned.
+    // Decodes into out in place of its contents. If encoded_string is out
+    // itself, or a view into it, it is decoded into a new string first.
     //
-    size_t approx_length_of_decoded_string = in_len / 4 * 3;
-    const size_t len                       = in_len - 4;
-    std::string ret;
-    ret.reserve(approx_length_of_decoded_string);
-
-    while (pos < len) {
-        const unsigned int chunk = pos_of_char(encoded_string[pos + 0]) << 18 | pos_of_char(encoded_string[pos + 1]) << 12 | pos_of_char(encoded_string[pos + 2]) << 6 | pos_of_char(encoded_string[pos + 3]);
-        ret.push_back(static_cast<std::string::value_type>(chunk >> 16 & 0xff));
-        ret.push_back(static_cast<std::string::value_type>(chunk >> 8 & 0xff));
-        ret.push_back(static_cast<std::string::value_type>(chunk & 0xff));
-        pos += 4;
+    if (!points_into(out, encoded_string.data())) {
+        out.clear();
+        return decode(encoded_string, out, remove_linebreaks);
     }
 
-    if (encoded_string[pos + 2] == '=' || encoded_string[pos + 2] == '.') {  // accept URL-safe base 64 strings, too, so check for '.' also.
-        const unsigned int chunk = pos_of_char(encoded_string[pos + 0]) << 6 | pos_of_char(encoded_string[pos + 1]);
-        ret.push_back(static_cast<std::string::value_type>(chunk >> 4 & 0xff));
-    } else if (encoded_string[pos + 3] == '=' || encoded_string[pos + 3] == '.') {
-        const unsigned int chunk = pos_of_char(encoded_string[pos + 0]) << 12 | pos_of_char(encoded_string[pos + 1]) << 6 | pos_of_char(encoded_string[pos + 2]);
-        ret.push_back(static_cast<std::string::value_type>(chunk >> 10 & 0xff));
-        ret.push_back(static_cast<std::string::value_type>(chunk >> 2 & 0xff));
-    } else {
-        const unsigned int chunk = pos_of_char(encoded_string[pos + 0]) << 18 | pos_of_char(encoded_string[pos + 1]) << 12 | pos_of_char(encoded_string[pos + 2]) << 6 | pos_of_char(encoded_string[pos + 3]);
-        ret.push_back(static_cast<std::string::value_type>(chunk >> 16 & 0xff));
-        ret.push_back(static_cast<std::string::value_type>(chunk >> 8 & 0xff));
-        ret.push_back(static_cast<std::string::value_type>(chunk & 0xff));
+    std::string         decoded;
+    const base64_result result = decode(encoded_string, decoded, remove_linebreaks);
+
+    out.swap(decoded);
+    return result;
+}
+
+template <typename String>
+static std::string decode(String const& encoded_string, bool remove_linebreaks) {
+    std::string ret;
+
+    if (decode(encoded_string, ret, remove_linebreaks).status != base64_status::ok) {
+        throw std::runtime_error("Input is not valid base64-encoded data.");
     }
 
     return ret;
@@ -237,10 +1807,26 @@ std::string base64_decode(std::string const& s, bool remove_linebreaks) {
     return decode(s, remove_linebreaks);
 }
 
+base64_result base64_decode(std::string const& s, std::string& out, bool remove_linebreaks) {
+    return decode_replacing(s, out, remove_linebreaks);
+}
+
+base64_result base64_decode_append(std::string& dst, std::string const& s, bool remove_linebreaks) {
+    return decode(s, dst, remove_linebreaks);
+}
+
+void base64_encode_append(std::string& dst, std::string const& s, bool url) {
+    encode_append(dst, s, url);
+}
+
 std::string base64_encode(std::string const& s, bool url) {
     return encode(s, url);
 }
 
+base64_buffer base64_encode_pooled(std::string const& s, bool url) {
+    return base64_encode_pooled(reinterpret_cast<const unsigned char*>(s.data()), s.length(), url);
+}
+
 std::string base64_encode_pem(std::string const& s) {
     return encode_pem(s);
 }
@@ -249,6 +1835,15 @@ std::string base64_encode_mime(std::string const& s) {
     return encode_mime(s);
 }
 
+std::string base64_encode_lines(unsigned char const* in, size_t len, size_t line_length, char const* separator, size_t separator_length, bool url) {
+    if (line_length == 0 || line_length % 4) {
+        throw std::invalid_argument("base64_encode_lines: line length must be a positive multiple of 4.");
+    }
+
+    const line_format format = {line_length, separator, separator_length};
+    return encode_with_line_breaks(in, len, format, url);
+}
+
 #if __cplusplus >= 201703L
 //
 // Interface with std::string_view rather than const std::string&
@@ -260,6 +1855,10 @@ std::string base64_encode(std::string_view s, bool url) {
     return encode(s, url);
 }
 
+base64_buffer base64_encode_pooled(std::string_view s, bool url) {
+    return base64_encode_pooled(reinterpret_cast<const unsigned char*>(s.data()), s.length(), url);
+}
+
 std::string base64_encode_pem(std::string_view s) {
     return encode_pem(s);
 }
@@ -272,4 +1871,16 @@ std::string base64_decode(std::string_view s, bool remove_linebreaks) {
     return decode(s, remove_linebreaks);
 }
 
+base64_result base64_decode(std::string_view s, std::string& out, bool remove_linebreaks) {
+    return decode_replacing(s, out, remove_linebreaks);
+}
+
+base64_result base64_decode_append(std::string& dst, std::string_view s, bool remove_linebreaks) {
+    return decode(s, dst, remove_linebreaks);
+}
+
+void base64_encode_append(std::string& dst, std::string_view s, bool url) {
+    encode_append(dst, s, url);
+}
+
 #endif  // __cplusplus >= 201703L
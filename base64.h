@@ -6,10 +6,16 @@
 #ifndef BASE64_H_C0CE2A47_D10E_42C9_A27C_C883944E704A
 #define BASE64_H_C0CE2A47_D10E_42C9_A27C_C883944E704A
 
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #if __cplusplus >= 201703L
+#include <cstddef>
 #include <string_view>
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
 #endif  // __cplusplus >= 201703L
 
 // clang-format off
@@ -21,6 +27,293 @@ std::string base64_encode_mime(std::string const& s);
 std::string base64_decode(std::string const& s, bool remove_linebreaks = false);
 std::string base64_encode(unsigned char const*, size_t len, bool url = false);
 
+//
+// Decoding without exceptions. Rather than throwing std::runtime_error,
+// these overloads return a status and the offset in s where decoding
+// failed (or the length of s if it succeeded). The decoded bytes are
+// stored in out, which is left empty if decoding fails. out may be s
+// itself.
+//
+// With remove_linebreaks, all decoders skip line breaks ('\n' and
+// '\r\n') and other whitespace (' ' and '\t') anywhere in s.
+//
+enum class base64_status {
+    ok,
+    invalid_char,     // s[offset] is not a base64 character
+    bad_length,       // the length of s is not a multiple of 4
+    bad_padding,      // the last quad is padded in its third but not in its fourth character
+    buffer_too_small  // see base64_encode_to() and base64_decode_to()
+};
+
+struct base64_result {
+    base64_status status;
+    size_t        offset;
+    size_t        length;  // number of bytes stored in out
+};
+
+base64_result base64_decode(std::string const& s, std::string& out, bool remove_linebreaks = false);
+
+//
+// Encoding and decoding into memory provided by the caller: out points to
+// cap bytes. Nothing is allocated and nothing beyond out[cap - 1] is
+// written. If cap is too small, nothing is written at all and the status
+// is buffer_too_small, with length set to the number of bytes needed.
+//
+base64_result base64_encode_to(char* out, size_t cap, unsigned char const* in, size_t len, bool url = false);
+base64_result base64_decode_to(unsigned char* out, size_t cap, char const* in, size_t len);
+
+//
+// Decoding in place: the len characters in buf are overwritten by the
+// bytes they decode to, and the number of bytes is returned in length.
+// If decoding fails, the contents of buf are unspecified; the string
+// overload then leaves s empty.
+//
+base64_result base64_decode_inplace(char* buf, size_t len);
+base64_result base64_decode_inplace(std::string& s);
+
+//
+// Exact sizes, for presizing buffers. base64_encoded_size() returns the
+// length of what base64_encode produces for n bytes, including the line
+// breaks that base64_encode_pem (line_length 64), base64_encode_mime
+// (line_length 76) and base64_encode_lines insert. url does not change
+// the length: url encoded strings are padded, too.
+//
+// base64_decoded_size() returns the number of bytes that s decodes to,
+// or 0 if decoding fails because of its length. The overload that
+// removes line breaks (and other whitespace, as the decoders do) is
+// constexpr only as of C++14.
+//
+#if __cplusplus >= 201402L
+#define BASE64_CONSTEXPR14 constexpr
+#else
+#define BASE64_CONSTEXPR14 inline
+#endif
+
+constexpr size_t base64_encoded_size(size_t n, bool /* url */ = false, size_t line_length = 0, size_t separator_length = 1) {
+    return (n + 2) / 3 * 4 + (line_length && n ? ((n + 2) / 3 * 4 - 1) / line_length * separator_length : 0);
+}
+
+constexpr size_t base64_decoded_size(char const* s, size_t len) {
+    return len == 0 || len % 4 ? 0 : len / 4 * 3 - (s[len - 2] == '=' || s[len - 2] == '.') - (s[len - 1] == '=' || s[len - 1] == '.');
+}
+
+BASE64_CONSTEXPR14 size_t base64_decoded_size(char const* s, size_t len, bool remove_linebreaks) {
+    if (!remove_linebreaks) return base64_decoded_size(s, len);
+
+    size_t chars = 0;
+    size_t pad   = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\n' || s[i] == '\r' || s[i] == ' ' || s[i] == '\t') continue;
+        //
+        // Only the last two characters count as padding.
+        //
+        pad = chars % 4 >= 2 && (s[i] == '=' || s[i] == '.') ? pad + 1 : 0;
+        chars++;
+    }
+
+    return chars % 4 ? 0 : chars / 4 * 3 - pad;
+}
+
+#undef BASE64_CONSTEXPR14
+
+//
+// Appending to an existing string: dst grows once and the result is
+// written after its current contents. It grows by exactly the encoded or
+// decoded size, except with remove_linebreaks: then it grows by three
+// quarters of the input's length and is cut back to the decoded size.
+// If decoding fails, dst is left as it was. Like std::string::append, the
+// input may be dst itself or lie within it.
+//
+void          base64_encode_append(std::string& dst, std::string const& s, bool url = false);
+void          base64_encode_append(std::string& dst, unsigned char const* in, size_t len, bool url = false);
+base64_result base64_decode_append(std::string& dst, std::string const& s, bool remove_linebreaks = false);
+
+//
+// Encoding with any line length and line separator, given at compile
+// time, such as CRLF line breaks for RFC 2045 MIME:
+//
+//     base64_encode_lines<76, '\r', '\n'>(s)
+//
+// The line length must be a positive multiple of 4. The last line is not
+// followed by a separator. base64_encode_pem and base64_encode_mime are
+// base64_encode_lines<64, '\n'> and base64_encode_lines<76, '\n'>.
+// The overload with run-time arguments throws std::invalid_argument for
+// other line lengths.
+//
+std::string base64_encode_lines(unsigned char const* in, size_t len, size_t line_length, char const* separator, size_t separator_length, bool url = false);
+
+template <size_t LineLength, char... Separator>
+std::string base64_encode_lines(unsigned char const* in, size_t len, bool url = false) {
+    static_assert(LineLength > 0 && LineLength % 4 == 0, "base64_encode_lines requires a line length that is a positive multiple of 4");
+    static_assert(sizeof...(Separator) > 0, "base64_encode_lines requires a separator");
+
+    static const char separator[] = {Separator...};
+    return base64_encode_lines(in, len, LineLength, separator, sizeof...(Separator), url);
+}
+
+template <size_t LineLength, char... Separator>
+std::string base64_encode_lines(std::string const& s, bool url = false) {
+    return base64_encode_lines<LineLength, Separator...>(reinterpret_cast<unsigned char const*>(s.data()), s.length(), url);
+}
+
+//
+// Encoding and decoding into contiguous ranges of byte-sized elements,
+// such as std::vector<uint8_t>, std::array<std::byte, N>, C arrays or, as
+// of C++20, std::span<std::byte>. base64_encode_to and base64_decode_to
+// write into the range as it is, like their pointer based counterparts.
+// base64_decode_into resizes out to exactly the decoded size first and
+// leaves it empty if decoding fails.
+//
+template <typename Range>
+base64_result base64_encode_to(Range&& out, unsigned char const* in, size_t len, bool url = false) {
+    static_assert(sizeof(out[0]) == 1, "base64_encode_to requires a range of bytes");
+    return base64_encode_to(out.size() ? reinterpret_cast<char*>(&out[0]) : nullptr, out.size(), in, len, url);
+}
+
+template <typename T, size_t N>
+base64_result base64_encode_to(T (&out)[N], unsigned char const* in, size_t len, bool url = false) {
+    static_assert(sizeof(T) == 1, "base64_encode_to requires an array of bytes");
+    return base64_encode_to(reinterpret_cast<char*>(out), N, in, len, url);
+}
+
+template <typename Range>
+base64_result base64_decode_to(Range&& out, char const* s, size_t len) {
+    static_assert(sizeof(out[0]) == 1, "base64_decode_to requires a range of bytes");
+    return base64_decode_to(out.size() ? reinterpret_cast<unsigned char*>(&out[0]) : nullptr, out.size(), s, len);
+}
+
+template <typename T, size_t N>
+base64_result base64_decode_to(T (&out)[N], char const* s, size_t len) {
+    static_assert(sizeof(T) == 1, "base64_decode_to requires an array of bytes");
+    return base64_decode_to(reinterpret_cast<unsigned char*>(out), N, s, len);
+}
+
+template <typename Container>
+base64_result base64_decode_into(Container& out, char const* s, size_t len) {
+    out.resize(base64_decoded_size(s, len));
+
+    const base64_result result = base64_decode_to(out, s, len);
+    if (result.status != base64_status::ok) out.clear();
+
+    return result;
+}
+
+//
+// Allocator-aware interface. base64_encode_as returns a String (such as a
+// std::basic_string with a custom allocator) and base64_decode_as returns
+// a Container of byte-sized elements with contiguous storage (such as
+// std::vector<unsigned char>), either constructed with alloc. Like
+// base64_decode, base64_decode_as throws std::runtime_error if s is not
+// valid base64.
+//
+template <typename String>
+String base64_encode_as(unsigned char const* in, size_t len, bool url = false, typename String::allocator_type const& alloc = typename String::allocator_type()) {
+    String       ret(alloc);
+    const size_t len_encoded = base64_encoded_size(len);
+#if defined(__cpp_lib_string_resize_and_overwrite)
+    //
+    // Spares zero-filling characters that are overwritten anyway, for
+    // Strings that can.
+    //
+    if constexpr (requires { ret.resize_and_overwrite(len_encoded, [](char*, size_t n) { return n; }); }) {
+        ret.resize_and_overwrite(len_encoded, [&](char* p, size_t n) { return base64_encode_to(p, n, in, len, url).length; });
+        return ret;
+    }
+#endif
+    ret.resize(len_encoded);
+    base64_encode_to(ret.empty() ? nullptr : &ret[0], ret.size(), in, len, url);
+    return ret;
+}
+
+template <typename Container>
+Container base64_decode_as(char const* s, size_t len, typename Container::allocator_type const& alloc = typename Container::allocator_type()) {
+    static_assert(sizeof(typename Container::value_type) == 1, "base64_decode_as requires a container of bytes");
+
+    Container ret(alloc);
+
+    if (base64_decode_into(ret, s, len).status != base64_status::ok) {
+        throw std::runtime_error("Input is not valid base64-encoded data.");
+    }
+
+    return ret;
+}
+
+//
+// Encoding many inputs at once, with two allocations for the whole batch.
+// The encodings are stored back to back in chars, in the layout Apache
+// Arrow uses for string columns: input i is encoded in
+// chars[offsets[i], offsets[i + 1]), and offsets has count + 1 entries.
+// The second overload reuses the memory of an existing batch.
+//
+struct base64_input {
+    unsigned char const* data;
+    size_t               length;
+};
+
+struct base64_batch {
+    std::string         chars;
+    std::vector<size_t> offsets;
+};
+
+base64_batch base64_encode_batch(base64_input const* inputs, size_t count, bool url = false);
+void         base64_encode_batch(base64_input const* inputs, size_t count, base64_batch& batch, bool url = false);
+
+//
+// Encoding into pooled buffers, for results that are used briefly and
+// then discarded. base64_encode_pooled returns a move-only handle to a
+// buffer taken from a pool owned by the calling thread. When the handle
+// is destroyed, the buffer and its capacity go back to the pool of the
+// thread destroying it, so that encoding in a loop allocates only until
+// the buffers are large enough. base64_get_pool_stats() reports on the
+// pool of the calling thread, and base64_trim_pool() frees its buffers.
+//
+class base64_buffer {
+  public:
+    base64_buffer() = default;
+    base64_buffer(base64_buffer&& other) noexcept;
+    base64_buffer& operator=(base64_buffer&& other) noexcept;
+    ~base64_buffer();
+
+    base64_buffer(base64_buffer const&)            = delete;
+    base64_buffer& operator=(base64_buffer const&) = delete;
+
+    char const*        data() const noexcept { return chars_.data(); }
+    size_t             size() const noexcept { return chars_.size(); }
+    std::string const& str() const noexcept { return chars_; }
+
+  private:
+    friend base64_buffer base64_encode_pooled(unsigned char const* in, size_t len, bool url);
+
+    std::string chars_;
+    bool        pooled_ = false;
+};
+
+struct base64_pool_stats {
+    size_t hits;            // buffers handed out from the pool
+    size_t misses;          // buffers that had to be created
+    size_t retained_bytes;  // capacity of the buffers in the pool
+    size_t retained_buffers;
+};
+
+base64_buffer     base64_encode_pooled(unsigned char const* in, size_t len, bool url = false);
+base64_buffer     base64_encode_pooled(std::string const& s, bool url = false);
+base64_pool_stats base64_get_pool_stats();
+void              base64_trim_pool();
+
+//
+// Encoding and decoding is done by the widest kernel the CPU supports.
+// It is chosen once, when base64_encode or base64_decode is first called.
+// The environment variable BASE64_KERNEL (scalar, sse, avx2 or avx512)
+// or base64_set_kernel() force a specific kernel. base64_set_kernel()
+// returns false and keeps the current kernel if the requested one is not
+// compiled in or not supported by the CPU.
+//
+enum class base64_kernel { automatic, scalar, sse, avx2, avx512 };
+
+bool          base64_set_kernel(base64_kernel kernel);
+base64_kernel base64_get_kernel();
+
 #if __cplusplus >= 201703L
 //
 // Interface with std::string_view rather than const std::string&
@@ -33,7 +326,32 @@ std::string base64_encode_pem (std::string_view s);
 std::string base64_encode_mime(std::string_view s);
 // clang-format on
 
-std::string base64_decode(std::string_view s, bool remove_linebreaks = false);
+std::string   base64_decode(std::string_view s, bool remove_linebreaks = false);
+base64_result base64_decode(std::string_view s, std::string& out, bool remove_linebreaks = false);
+
+void          base64_encode_append(std::string& dst, std::string_view s, bool url = false);
+base64_result base64_decode_append(std::string& dst, std::string_view s, bool remove_linebreaks = false);
+
+template <size_t LineLength, char... Separator>
+std::string base64_encode_lines(std::string_view s, bool url = false) {
+    return base64_encode_lines<LineLength, Separator...>(reinterpret_cast<unsigned char const*>(s.data()), s.length(), url);
+}
+
+base64_buffer base64_encode_pooled(std::string_view s, bool url = false);
+
+#if __has_include(<memory_resource>)
+//
+// Results allocated from a std::pmr::memory_resource, such as a
+// monotonic arena that is released as a whole.
+//
+inline std::pmr::string base64_encode_pmr(std::string_view s, bool url = false, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) {
+    return base64_encode_as<std::pmr::string>(reinterpret_cast<unsigned char const*>(s.data()), s.length(), url, resource);
+}
+
+inline std::pmr::vector<std::byte> base64_decode_pmr(std::string_view s, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) {
+    return base64_decode_as<std::pmr::vector<std::byte>>(s.data(), s.length(), resource);
+}
+#endif  // __has_include(<memory_resource>)
 #endif  // __cplusplus >= 201703L
 
 #endif /* BASE64_H_C0CE2A47_D10E_42C9_A27C_C883944E704A */
@@ -1,5 +1,198 @@
 #include "base64.h"
+#include <array>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+static std::string reference_encode(std::string const& s, bool url) {
+    //
+    // Straightforward bit-by-bit encoder to compare the optimized
+    // encoders against.
+    //
+    const char* chars = url ? "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+                            : "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string ret;
+    unsigned int bits = 0;
+    unsigned int nbits = 0;
+
+    for (size_t i = 0; i < s.length(); i++) {
+        bits = bits << 8 | static_cast<unsigned char>(s[i]);
+        nbits += 8;
+        while (nbits >= 6) {
+            nbits -= 6;
+            ret.push_back(chars[bits >> nbits & 0x3f]);
+        }
+    }
+    if (nbits) ret.push_back(chars[bits << (6 - nbits) & 0x3f]);
+    while (ret.length() % 4) ret.push_back(url ? '.' : '=');
+
+    return ret;
+}
+
+static bool test_kernel(std::string const& all_bytes, const char* kernel_name) {
+    bool all_tests_passed = true;
+
+    //
+    // Inputs of all lengths up to a few hundred bytes, so that the
+    // vectorized encoders and their scalar tails are all exercised.
+    //
+    for (size_t len = 0; len <= all_bytes.length(); len++) {
+        const std::string s = all_bytes.substr(0, len);
+
+        if (base64_encode(s, false) != reference_encode(s, false) || base64_encode(s, true) != reference_encode(s, true)) {
+            std::cout << "Failed to encode string of length " << len << kernel_name << std::endl;
+            return false;
+        }
+
+        if (base64_decode(base64_encode(s, false)) != s || base64_decode(base64_encode(s, true)) != s) {
+            std::cout << "Failed to decode string of length " << len << kernel_name << std::endl;
+            return false;
+        }
+
+        //
+        // Buffers of exactly the right size, followed by a guard byte
+        // that must not be overwritten.
+        //
+        const std::string encoded = reference_encode(s, len % 2);
+        std::string       out_encoded(encoded.length() + 1, '#');
+        std::string       out_decoded(len + 1, '#');
+
+        const base64_result result_encoded = base64_encode_to(&out_encoded[0], encoded.length(), reinterpret_cast<unsigned char const*>(s.data()), len, len % 2);
+        const base64_result result_decoded = base64_decode_to(reinterpret_cast<unsigned char*>(&out_decoded[0]), len, encoded.data(), encoded.length());
+
+        if (result_encoded.status != base64_status::ok || result_encoded.length != encoded.length() || out_encoded != encoded + '#' ||
+            result_decoded.status != base64_status::ok || result_decoded.length != len || out_decoded != s + '#') {
+            std::cout << "Failed to encode or decode into a buffer for length " << len << kernel_name << std::endl;
+            return false;
+        }
+
+        std::string pem  = reference_encode(s, false);
+        std::string mime = pem;
+        for (size_t i = 64; i < pem.length(); i += 65) pem.insert(i, "\n");
+        for (size_t i = 76; i < mime.length(); i += 77) mime.insert(i, "\n");
+
+        if (base64_encode_pem(s) != pem || base64_encode_mime(s) != mime) {
+            std::cout << "Failed to encode with line breaks for length " << len << kernel_name << std::endl;
+            return false;
+        }
+
+        std::string crlf = mime;
+        for (size_t i = 76; i < crlf.length(); i += 78) crlf.insert(i, "\r");
+
+        if (base64_decode(pem, true) != s || base64_decode(crlf, true) != s) {
+            std::cout << "Failed to decode with line breaks for length " << len << kernel_name << std::endl;
+            return false;
+        }
+
+        //
+        // Other line lengths and separators, including one too long for
+        // the AVX-512 kernel to blend into the end of a line.
+        //
+        const char  separator[] = "\r\n------------\r\n";
+        std::string short_lines = reference_encode(s, false);
+        std::string long_lines  = reference_encode(s, true);
+        for (size_t i = 12; i < short_lines.length(); i += 13) short_lines.insert(i, " ");
+        for (size_t i = 120; i < long_lines.length(); i += 136) long_lines.insert(i, separator);
+
+        if (base64_encode_lines<76, '\r', '\n'>(s) != crlf || base64_encode_lines<12, ' '>(s) != short_lines ||
+            base64_encode_lines(reinterpret_cast<unsigned char const*>(s.data()), len, 120, separator, 16, true) != long_lines) {
+            std::cout << "Failed to encode with custom line breaks for length " << len << kernel_name << std::endl;
+            return false;
+        }
+
+        std::string inplace = encoded;
+
+        if (base64_decode_inplace(inplace).status != base64_status::ok || inplace != s) {
+            std::cout << "Failed to decode in place for length " << len << kernel_name << std::endl;
+            return false;
+        }
+    }
+
+    //
+    // '-' and '_' are accepted in place of '+' and '/' (and vice versa),
+    // and an invalid character anywhere in a long input is reported.
+    //
+    const std::string mixed_orig    = all_bytes.substr(0, 300);
+    std::string       mixed_encoded = base64_encode(mixed_orig, false);
+    for (size_t i = 0; i < mixed_encoded.length(); i += 2) {
+        if (mixed_encoded[i] == '+') mixed_encoded[i] = '-';
+        if (mixed_encoded[i] == '/') mixed_encoded[i] = '_';
+    }
+
+    if (base64_decode(mixed_encoded) != mixed_orig) {
+        std::cout << "Failed to decode mixed alphabets" << kernel_name << std::endl;
+        all_tests_passed = false;
+    }
+
+    for (size_t i = 0; i < mixed_encoded.length() - 4; i++) {
+        std::string invalid = mixed_encoded;
+        invalid[i]          = i % 2 ? '*' : '\x80';
+
+        bool caught = false;
+        try {
+            base64_decode(invalid);
+        } catch (std::runtime_error const&) {
+            caught = true;
+        }
+
+        if (!caught) {
+            std::cout << "Failed to reject invalid character at " << i << kernel_name << std::endl;
+            return false;
+        }
+
+        std::string         out;
+        const base64_result result         = base64_decode(invalid, out);
+        const base64_result result_inplace = base64_decode_inplace(invalid);
+
+        if (result.status != base64_status::invalid_char || result.offset != i || !out.empty() ||
+            result_inplace.status != base64_status::invalid_char || result_inplace.offset != i || !invalid.empty()) {
+            std::cout << "Failed to report invalid character at " << i << kernel_name << std::endl;
+            return false;
+        }
+    }
+
+    //
+    // Irregular whitespace over several of the tiles that line-wrapped
+    // input is compacted in, with tile boundaries falling inside quads,
+    // and an invalid character late in the input.
+    //
+    std::string big;
+    while (big.length() < 20000) big += all_bytes;
+
+    const std::string big_encoded = base64_encode(big, false);
+    std::string       messy;
+    for (size_t i = 0; i < big_encoded.length(); i++) {
+        if (i % 37 == 0) messy += " \t";
+        if (i % 101 == 0) messy += "\r\n";
+        if (i % 1031 == 0) messy.append(i % 7, ' ');
+        messy += big_encoded[i];
+    }
+    messy += "\r\n";
+
+    if (base64_decode(messy, true) != big) {
+        std::cout << "Failed to decode with irregular whitespace" << kernel_name << std::endl;
+        all_tests_passed = false;
+    }
+
+    const size_t invalid_at = messy.find_last_not_of(" \t\r\n=", messy.length() - 2000);
+    messy[invalid_at]       = '*';
+
+    std::string         messy_out;
+    const base64_result messy_result = base64_decode(messy, messy_out, true);
+
+    if (messy_result.status != base64_status::invalid_char || messy_result.offset != invalid_at || !messy_out.empty()) {
+        std::cout << "Failed to report invalid character among irregular whitespace" << kernel_name << std::endl;
+        all_tests_passed = false;
+    }
+
+    return all_tests_passed;
+}
 
 int main() {
 
@@ -154,25 +347,314 @@ int main() {
 
     // --------------------------------------------------------------
 
+    //
+    // Run the following tests with every kernel the CPU supports.
+    //
+    std::string all_bytes;
+    for (int i = 0; i < 600; i++) all_bytes.push_back(static_cast<char>(i * 7 + i / 256));
+
+    const base64_kernel kernels[]   = {base64_kernel::scalar, base64_kernel::sse, base64_kernel::avx2, base64_kernel::avx512};
+    const char* const kernel_names[] = {" (scalar)", " (sse)", " (avx2)", " (avx512)"};
+
+    for (size_t k = 0; k < 4; k++) {
+        if (!base64_set_kernel(kernels[k])) continue;
+
+        if (base64_get_kernel() != kernels[k]) {
+            std::cout << "Failed to select kernel" << kernel_names[k] << std::endl;
+            all_tests_passed = false;
+        }
+
+        if (!test_kernel(all_bytes, kernel_names[k])) all_tests_passed = false;
+    }
+
+    base64_set_kernel(base64_kernel::automatic);
+
+    // --------------------------------------------------------------
+
+    //
+    // Decoding without exceptions reports what is wrong and where.
+    //
+    struct {
+        const char*   encoded;
+        bool          remove_linebreaks;
+        base64_status status;
+        size_t        offset;
+        const char*   decoded;
+    } status_tests[] = {
+      // clang-format off
+      {"YWJjZA==",              false, base64_status::ok,           8,  "abcd" },
+      {"YWJjZGU.",              false, base64_status::ok,           8,  "abcde"},
+      {"",                      false, base64_status::ok,           0,  ""     },
+      {"YWJj*A==",              false, base64_status::invalid_char, 4,  ""     },
+      {"YWJjZ=A=",              false, base64_status::invalid_char, 5,  ""     },
+      {"YWJjZA=",               false, base64_status::bad_length,   7,  ""     },
+      {"Y",                     false, base64_status::bad_length,   1,  ""     },
+      {"YQ",                    false, base64_status::bad_length,   2,  ""     },
+      {"YWJ",                   false, base64_status::bad_length,   3,  ""     },
+      {"A===",                  false, base64_status::invalid_char, 1,  ""     },
+      {"YWJjZA=A",              false, base64_status::bad_padding,  7,  ""     },
+      {"YWJj\nZA==",            true,  base64_status::ok,           9,  "abcd" },
+      {"YWJj\nZ*==",            true,  base64_status::invalid_char, 6,  ""     },
+      {" YW\tJj\r\nZA==\r\n",   true,  base64_status::ok,           14, "abcd" },
+      {"YWJj\r\nZA=",           true,  base64_status::bad_length,   9,  ""     },
+      {"YWJj\r\nZA=\nA",        true,  base64_status::bad_padding,  10, ""     },
+      {"YQ==\r\nYQ==",          true,  base64_status::invalid_char, 2,  ""     },
+      // clang-format on
+    };
+
+    for (size_t i = 0; i < sizeof(status_tests) / sizeof(status_tests[0]); i++) {
+        std::string         out    = "not empty";
+        const base64_result result = base64_decode(std::string(status_tests[i].encoded), out, status_tests[i].remove_linebreaks);
+
+        //
+        // Decoding a string into itself replaces it with the result.
+        //
+        std::string         self        = status_tests[i].encoded;
+        const base64_result result_self = base64_decode(self, self, status_tests[i].remove_linebreaks);
+
+        if (result.status != status_tests[i].status || result.offset != status_tests[i].offset || out != status_tests[i].decoded ||
+            result_self.status != status_tests[i].status || result_self.offset != status_tests[i].offset || self != status_tests[i].decoded) {
+            std::cout << "Failed to decode " << status_tests[i].encoded << " without exceptions" << std::endl;
+            all_tests_passed = false;
+        }
+    }
+
+    //
+    // A buffer that is one byte too small is left untouched.
+    //
+    char          small_encoded[8] = {'#', '#', '#', '#', '#', '#', '#', '#'};
+    unsigned char small_decoded[5] = {'#', '#', '#', '#', '#'};
+
+    const base64_result small_encode_result = base64_encode_to(small_encoded, 7, reinterpret_cast<unsigned char const*>("abcde"), 5);
+    const base64_result small_decode_result = base64_decode_to(small_decoded, 4, "YWJjZGU=", 8);
+
+    if (small_encode_result.status != base64_status::buffer_too_small || small_encode_result.length != 8 || small_encoded[0] != '#' ||
+        small_decode_result.status != base64_status::buffer_too_small || small_decode_result.length != 5 || small_decoded[0] != '#') {
+        std::cout << "Failed to reject a buffer that is too small" << std::endl;
+        all_tests_passed = false;
+    }
+
+    // --------------------------------------------------------------
+
+    //
+    // The size calculators agree with what is actually produced.
+    //
+    static_assert(base64_encoded_size(5) == 8 && base64_decoded_size("YWJjZGU=", 8) == 5, "base64 sizes are not constexpr");
+
+    for (size_t len = 0; len <= 300; len++) {
+        const std::string s    = all_bytes.substr(0, len);
+        const std::string pem  = base64_encode_pem(s);
+        const std::string mime = base64_encode_mime(s);
+        const std::string crlf = base64_encode_lines<76, '\r', '\n'>(s);
+
+        if (base64_encoded_size(len) != base64_encode(s).length() || base64_encoded_size(len, true) != base64_encode(s, true).length() ||
+            base64_encoded_size(len, false, 64) != pem.length() || base64_encoded_size(len, false, 76) != mime.length() ||
+            base64_encoded_size(len, false, 76, 2) != crlf.length() ||
+            base64_decoded_size(pem.data(), pem.length(), true) != len || base64_decoded_size(mime.data(), mime.length(), true) != len) {
+            std::cout << "Failed to calculate the size for length " << len << std::endl;
+            all_tests_passed = false;
+            break;
+        }
+    }
+
+    bool caught_line_length = false;
+    try {
+        base64_encode_lines(reinterpret_cast<unsigned char const*>("abc"), 3, 6, "\n", 1);
+    } catch (std::invalid_argument const&) {
+        caught_line_length = true;
+    }
+
+    if (!caught_line_length) {
+        std::cout << "Failed to reject a line length that is not a multiple of 4" << std::endl;
+        all_tests_passed = false;
+    }
+
+    // --------------------------------------------------------------
+
+    //
+    // Appending keeps what is already there, and a failed decode leaves
+    // the destination unchanged.
+    //
+    std::string body = "{\"data\": \"";
+    base64_encode_append(body, std::string("abcde"));
+    base64_encode_append(body, reinterpret_cast<unsigned char const*>("fgh"), 3, true);
+    body += "\"}";
+
+    if (body != "{\"data\": \"YWJjZGU=Zmdo\"}") {
+        std::cout << "Failed to encode by appending" << std::endl;
+        all_tests_passed = false;
+    }
+
+    std::string appended = "abc";
+    if (base64_decode_append(appended, std::string("ZGVm")).status != base64_status::ok || appended != "abcdef" ||
+        base64_decode_append(appended, std::string("Z*lq")).status != base64_status::invalid_char || appended != "abcdef" ||
+        base64_decode_append(appended, std::string("Z2\nhp"), true).length != 3 || appended != "abcdefghi") {
+        std::cout << "Failed to decode by appending" << std::endl;
+        all_tests_passed = false;
+    }
+
+    //
+    // Appending a string to itself, with room for neither the encoded nor
+    // the decoded result, so that growing it moves the input.
+    //
+    const std::string self_plain(300, 'a');
+    const std::string self_encoded = base64_encode(self_plain);
+    const std::string self_mime    = base64_encode_mime(self_plain);
+
+    std::string self_encode = self_plain;
+    std::string self_decode = self_encoded;
+    std::string self_lines  = self_mime;
+    self_encode.shrink_to_fit();
+    self_decode.shrink_to_fit();
+    self_lines.shrink_to_fit();
+
+    base64_encode_append(self_encode, self_encode);
+
+    if (self_encode != self_plain + self_encoded || base64_decode_append(self_decode, self_decode).status != base64_status::ok ||
+        self_decode != self_encoded + self_plain || base64_decode_append(self_lines, self_lines, true).status != base64_status::ok ||
+        self_lines != self_mime + self_plain) {
+        std::cout << "Failed to append a string to itself" << std::endl;
+        all_tests_passed = false;
+    }
+
+    // --------------------------------------------------------------
+
+    //
+    // Results in other containers and with other allocators.
+    //
+    const std::vector<unsigned char> as_vector = base64_decode_as<std::vector<unsigned char>>("YWJjZGU=", 8);
+    const std::string                as_string = base64_encode_as<std::string>(as_vector.data(), as_vector.size(), true);
+
+    if (as_vector != std::vector<unsigned char>{'a', 'b', 'c', 'd', 'e'} || as_string != "YWJjZGU.") {
+        std::cout << "Failed to encode or decode with base64_encode_as or base64_decode_as" << std::endl;
+        all_tests_passed = false;
+    }
+
+    // --------------------------------------------------------------
+
+    //
+    // Byte containers, fixed-size arrays and (as of C++20) spans.
+    //
+    const std::vector<uint8_t> expected = {'a', 'b', 'c', 'd', 'e'};
+
+    std::vector<uint8_t>   into_vector(100, 0);
+    std::array<uint8_t, 8> to_array;
+    char                   to_c_array[8];
+
+    const base64_result into_result  = base64_decode_into(into_vector, "YWJjZGU=", 8);
+    const base64_result array_result = base64_decode_to(to_array, "YWJjZGVmZ2g=", 12);
+    const base64_result c_result     = base64_encode_to(to_c_array, to_array.data(), 4);
+
+    if (into_result.status != base64_status::ok || into_vector != expected ||
+        array_result.status != base64_status::ok || array_result.length != 8 || to_array[7] != 'h' ||
+        c_result.status != base64_status::ok || std::string(to_c_array, 8) != "YWJjZA==" ||
+        base64_decode_into(into_vector, "YWJj*A==", 8).status != base64_status::invalid_char || !into_vector.empty() ||
+        base64_decode_to(to_array, "YWJjZGVmZ2hp", 12).status != base64_status::buffer_too_small) {
+        std::cout << "Failed to encode or decode with containers of bytes" << std::endl;
+        all_tests_passed = false;
+    }
+
+#if __cplusplus >= 202002L
+    std::byte span_buffer[16];
+
+    const base64_result span_result = base64_decode_to(std::span<std::byte>(span_buffer).subspan(4), "YWJjZGU=", 8);
+
+    if (span_result.status != base64_status::ok || span_result.length != 5 || span_buffer[8] != std::byte{'e'}) {
+        std::cout << "Failed to decode into a span" << std::endl;
+        all_tests_passed = false;
+    }
+#endif
+
+    // --------------------------------------------------------------
+
+    //
+    // Batches put all encodings into one arena.
+    //
+    const base64_input batch_inputs[] = {
+      {reinterpret_cast<unsigned char const*>(all_bytes.data()), 0  },
+      {reinterpret_cast<unsigned char const*>(all_bytes.data()), 5  },
+      {reinterpret_cast<unsigned char const*>(all_bytes.data()), 100},
+      {reinterpret_cast<unsigned char const*>(all_bytes.data()), 31 },
+    };
+    const base64_batch batch = base64_encode_batch(batch_inputs, 4, true);
+
+    bool batch_ok = batch.offsets.size() == 5 && batch.offsets[0] == 0 && batch.offsets[4] == batch.chars.size();
+    for (size_t i = 0; batch_ok && i < 4; i++) {
+        batch_ok = batch.chars.substr(batch.offsets[i], batch.offsets[i + 1] - batch.offsets[i]) == base64_encode(batch_inputs[i].data, batch_inputs[i].length, true);
+    }
+
+    if (!batch_ok) {
+        std::cout << "Failed to encode a batch" << std::endl;
+        all_tests_passed = false;
+    }
+
+    // --------------------------------------------------------------
+
+    //
+    // Pooled buffers are reused once they are handed back.
+    //
+    base64_trim_pool();
+    const base64_pool_stats stats_before = base64_get_pool_stats();
+
+    for (size_t i = 0; i < 3; i++) {
+        const base64_buffer pooled = base64_encode_pooled(all_bytes.substr(0, 100 + i));
+
+        if (pooled.str() != base64_encode(all_bytes.substr(0, 100 + i))) {
+            std::cout << "Failed to encode into a pooled buffer" << std::endl;
+            all_tests_passed = false;
+        }
+    }
+
+    base64_buffer moved = base64_encode_pooled(std::string("abc"));
+    moved               = base64_encode_pooled(std::string("abcd"));
+
+    const base64_pool_stats stats_after = base64_get_pool_stats();
+
+    if (std::string(moved.data(), moved.size()) != "YWJjZA==" || stats_after.misses - stats_before.misses != 2 || stats_after.hits - stats_before.hits != 3 ||
+        stats_after.retained_buffers != 1 || stats_after.retained_bytes < 136) {
+        std::cout << "Failed to reuse pooled buffers" << std::endl;
+        all_tests_passed = false;
+    }
+
+    // --------------------------------------------------------------
+
 #if __cplusplus >= 201703L
     //
     // Test the string_view interface (which required C++17)
     //
-    std::string_view sv_orig    = "foobarbaz";
-    std::string_view sv_encoded = base64_encode(sv_orig);
+    std::string_view sv_orig = "foobarbaz";
+    std::string sv_encoded   = base64_encode(sv_orig);
 
     if (sv_encoded != "Zm9vYmFyYmF6") {
         std::cout << "Failed to encode with string_view" << std::endl;
         all_tests_passed = false;
     }
 
-    std::string_view sv_decoded = base64_decode(sv_encoded);
+    std::string sv_decoded = base64_decode(std::string_view(sv_encoded));
 
     if (sv_decoded != sv_orig) {
         std::cout << "Failed to decode with string_view" << std::endl;
         all_tests_passed = false;
     }
 
+#if __has_include(<memory_resource>)
+    //
+    // Everything comes from the arena: its upstream resource refuses to
+    // allocate.
+    //
+    char                                arena[1024];
+    std::pmr::monotonic_buffer_resource resource(arena, sizeof(arena), std::pmr::null_memory_resource());
+
+    const std::pmr::string            pmr_encoded = base64_encode_pmr(all_bytes.substr(0, 300), false, &resource);
+    const std::pmr::vector<std::byte> pmr_decoded = base64_decode_pmr(pmr_encoded, &resource);
+
+    if (std::string_view(pmr_encoded) != base64_encode(all_bytes.substr(0, 300)) || pmr_decoded.size() != 300 ||
+        std::memcmp(pmr_decoded.data(), all_bytes.data(), 300)) {
+        std::cout << "Failed to encode or decode with std::pmr" << std::endl;
+        all_tests_passed = false;
+    }
+#endif
+
 #endif
 
     if (all_tests_passed) return 0;